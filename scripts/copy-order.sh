@@ -0,0 +1,17 @@
+#!/bin/bash
+# Compares the run time and collection pauses of a bytecode program when
+# the collector copies objects in breadth first and in depth first order.
+# Without a program it runs bench/lists.feeny, which builds 100000 lists
+# of 64 nodes, collects, and then walks every list five times.
+# Usage: scripts/copy-order.sh [program.bc] [cfeeny options]
+BC=$1; shift
+if [ -z "$BC" ]; then
+  BC=/tmp/copy-order-lists.bc
+  bin/feeny -i bench/lists.feeny -o $BC > /dev/null || exit 1
+fi
+TIMEFORMAT=%R
+for order in breadth depth; do
+  out=$( { time bin/cfeeny -gcstats -copyorder $order "$@" -bc $BC > /tmp/copy-order.out; } 2>&1 )
+  pause=$(awk '/total pause/ {print $3}' /tmp/copy-order.out)
+  printf "%-8s %8s s run %10s ms pause\n" $order $out $pause
+done
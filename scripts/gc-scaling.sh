@@ -0,0 +1,13 @@
+#!/bin/bash
+# Prints a chart of the total garbage collection pause of a bytecode
+# program when collected with 1 to 16 GC threads.
+# Usage: scripts/gc-scaling.sh program.bc [cfeeny options]
+BC=$1; shift
+for n in 1 2 4 8 12 16; do
+  ms=$(bin/cfeeny -gcstats -gcthreads $n "$@" -bc $BC | awk '/total pause/ {print $3}')
+  echo "$n $ms"
+done | awk '
+  NR == 1 { base = $2 }
+  { printf("%2d threads %10.3f ms %5.2fx ", $1, $2, base / $2)
+    for(i = 0; i < 40 * base / $2 / 16 && i < 40; i++) printf("#")
+    printf("\n") }'
@@ -7,11 +7,28 @@
 #include "ast.h"
 
 void interpret_bc (char* filename) {  
+  start_trace();
+  start_perf();
+  double start = now_ms();
   Program* p = load_bytecode(filename);
+  trace_phase("load", "startup", start);
+  start = now_ms();
   print_prog(p);
   printf("\n\n");
-  initvm(link_program(p));
+  trace_phase("print", "startup", start);
+  perf_phase(PERF_LINK);
+  start = now_ms();
+  char* entry = link_program(p);
+  trace_phase("link", "startup", start);
+  perf_phase(PERF_INIT);
+  start = now_ms();
+  initvm(entry);
+  trace_phase("initvm", "startup", start);
+  perf_phase(PERF_RUN);
+  start = now_ms();
   runvm();  
+  trace_phase("run", "run", start);
+  finish_trace();
 }
 
 void interpret_ast (char* filename) {  
@@ -21,24 +38,138 @@ void interpret_ast (char* filename) {
   interpret(s);
 }
 
+//Parses the option at argvs[i], and returns the number of arguments
+//it consumed.
+int parse_option (char** argvs, int i, int n) {
+  char* opt = argvs[i];
+  if(strcmp(opt, "-icstats") == 0){
+    opt_ic_stats = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-disasm") == 0){
+    opt_disasm = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-regs") == 0){
+    opt_regs = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-gcstats") == 0){
+    opt_gc_stats = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-profile") == 0){
+    opt_profile = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-tracecalls") == 0){
+    opt_trace_calls = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-perf") == 0){
+    opt_perf = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-gen") == 0){
+    opt_gen = 1;
+    return 1;
+  }
+  if(strcmp(opt, "-immix") == 0){
+    opt_immix = 1;
+    return 1;
+  }
+  char** arg = 0;
+  if(strcmp(opt, "-super") == 0)
+    arg = &opt_super;
+  else if(strcmp(opt, "-superprofile") == 0)
+    arg = &opt_super_profile;
+  else if(strcmp(opt, "-pairprofile") == 0)
+    arg = &opt_pair_profile;
+  else if(strcmp(opt, "-heapinit") == 0)
+    arg = &opt_heap_init;
+  else if(strcmp(opt, "-heapmax") == 0)
+    arg = &opt_heap_max;
+  else if(strcmp(opt, "-nursery") == 0)
+    arg = &opt_nursery;
+  else if(strcmp(opt, "-gcthreads") == 0)
+    arg = &opt_gc_threads;
+  else if(strcmp(opt, "-incremental") == 0)
+    arg = &opt_incremental;
+  else if(strcmp(opt, "-largearray") == 0)
+    arg = &opt_large_array;
+  else if(strcmp(opt, "-copyorder") == 0)
+    arg = &opt_copy_order;
+  else if(strcmp(opt, "-pretenure") == 0)
+    arg = &opt_pretenure;
+  else if(strcmp(opt, "-sample") == 0)
+    arg = &opt_sample;
+  else if(strcmp(opt, "-samplerate") == 0)
+    arg = &opt_sample_rate;
+  else if(strcmp(opt, "-trace") == 0)
+    arg = &opt_trace;
+  else if(strcmp(opt, "-gclog") == 0)
+    arg = &opt_gc_log;
+  else if(strcmp(opt, "-backing") == 0)
+    arg = &opt_backing;
+  else{
+    printf("Unrecognized option: %s\n", opt);
+    exit(-1);
+  }
+  if(i + 1 >= n){
+    printf("Expected argument to option: %s\n", opt);
+    exit(-1);
+  }
+  *arg = argvs[i + 1];
+  return 2;
+}
+
 //Usage:
 //cfeeny -ast bsearch.ast
-//cfeeny -bc bsearch.bc
+//cfeeny [options] -bc bsearch.bc
+//
+//Options:
+//   -icstats : Print inline cache statistics on exit.
+//   -disasm : Print the linked (and quickened) code on exit.
+//   -super <names> : Comma separated superinstructions to use, or none.
+//   -superprofile <file> : Use the superinstructions that are frequent in a pair profile.
+//   -pairprofile <file> : Write executed instruction pair counts to file.
+//   -profile : Count executed instructions, instruction pairs and method calls, and print a report on exit.
+//   -sample <file> : Sample the call stack on a wall-clock timer and write folded stacks to file.
+//   -samplerate <hz> : Samples per second of wall-clock time for -sample. The default is 1000.
+//   -trace <file> : Write a timeline of the run to file in Chrome trace event format.
+//   -tracecalls : Also trace each top-level call in the timeline.
+//   -perf : Print hardware performance counters per phase, and per method with -profile.
+//   -regs : Translate to register code and run it with the register interpreter.
+//   -heapinit <size> : Initial size of each semispace, e.g. 512k or 4m.
+//   -heapmax <size> : Maximum size of each semispace.
+//   -gen : Use the generational collector.
+//   -nursery <size> : Size of the nursery of the generational collector.
+//   -gcthreads <n> : Number of threads used to copy objects in a full collection.
+//   -incremental <us> : Collect incrementally in pauses of about us microseconds.
+//   -largearray <size> : Arrays of at least this size are kept in the large object space.
+//   -immix : Use the mark-region collector instead of the semispaces.
+//   -copyorder <order> : Copy objects in breadth or depth first order.
+//   -pretenure <percent> : Pretenure the allocation sites whose objects survive this often.
+//   -backing <modes> : Comma separated heap and code backing modes: huge, prefault, release.
+//   -gcstats : Print the number of garbage collections and their pauses on exit.
+//   -gclog <file> : Write a line of JSON for each garbage collection pause to file.
 int main (int argc, char** argvs) {
   //Check number of arguments
-  if(argc != 3){
-    printf("Expected 2 arguments to commandline.\n");
+  if(argc < 3){
+    printf("Expected at least 2 arguments to commandline.\n");
     exit(-1);
   }
-  if(strcmp(argvs[1], "-ast") == 0)
-    interpret_ast(argvs[2]);
-  else if(strcmp(argvs[1], "-bc") == 0)
-    interpret_bc(argvs[2]);
+  for(int i=1; i<argc-2; )
+    i += parse_option(argvs, i, argc-2);
+  char* flag = argvs[argc-2];
+  char* file = argvs[argc-1];
+  if(strcmp(flag, "-ast") == 0)
+    interpret_ast(file);
+  else if(strcmp(flag, "-bc") == 0)
+    interpret_bc(file);
   else{
-    printf("Unrecognized flag: %s\n", argvs[1]);
+    printf("Unrecognized flag: %s\n", flag);
     exit(-1);
   }
   return 0;
 }
-
-
@@ -1,33 +1,150 @@
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<signal.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<pthread.h>
+#include<sched.h>
+#include<time.h>
+#include<sys/resource.h>
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
 #include "utils.h"
 #include "bytecode.h"
 #include "vm.h"
 
+//The interpreter uses direct-threaded dispatch when the compiler
+//supports labels as values: the linker writes the address of each
+//opcode handler in place of the opcode tag. Compile with
+//-DSWITCH_DISPATCH to use the portable switch loop instead.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+//Compile with -DTOS_CACHE to keep the top of the operand stack in a
+//local of the stack interpreter loop. See run_loop.
+
+void** run_loop (int get_handlers);
+void** reg_loop (int get_handlers);
+void add_profile_method (MethodValue* v, char* name, int idx);
+void set_profile_pos (int i, int n, long pos);
+
 //============================================================
 //===================== LINKER ===============================
 //============================================================
 
+//======== MEMORY BACKING ===============
+//The code buffer and the heap spaces are mapped with map_memory. The
+//-backing option, or FEENY_BACKING, is a comma separated list of:
+//- huge: Align mappings of at least HUGE_PAGE_SIZE bytes to a huge
+//  page and ask for transparent huge pages with MADV_HUGEPAGE.
+//- prefault: Touch every page of a new mapping, so that its page
+//  faults are taken when it is mapped instead of while it is filled.
+//- release: Give the pages of the idle semispace back to the OS with
+//  MADV_DONTNEED after each flip.
+#define HUGE_PAGE_SIZE (2L * 1024 * 1024)
+#define SMALL_PAGE_SIZE 4096L
+
+char* opt_backing;
+int huge_pages;
+int prefault;
+int release_idle;
+
+void init_backing () {
+  if(!opt_backing)
+    opt_backing = getenv("FEENY_BACKING");
+  if(!opt_backing)
+    return;
+  char* list = strdup(opt_backing);
+  for(char* name = strtok(list, ","); name; name = strtok(0, ",")){
+    if(strcmp(name, "huge") == 0)
+      huge_pages = 1;
+    else if(strcmp(name, "prefault") == 0)
+      prefault = 1;
+    else if(strcmp(name, "release") == 0)
+      release_idle = 1;
+    else if(strcmp(name, "none") != 0){
+      printf("Unknown backing: %s\n", name);
+      exit(-1);
+    }
+  }
+  free(list);
+}
+
+void touch_pages (char* mem, long sz) {
+  for(long i=0; i<sz; i+=SMALL_PAGE_SIZE)
+    ((volatile char*)mem)[i] = 0;
+}
+
+//Maps sz bytes of zeroed memory, with the given mmap flags in addition
+//to the usual ones. Reserved mappings (MAP_NORESERVE) are not
+//prefaulted.
+char* map_memory (long sz, int flags) {
+  int huge = huge_pages && sz >= HUGE_PAGE_SIZE;
+  long len = huge? sz + HUGE_PAGE_SIZE : sz;
+  char* mem = mmap(0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if(mem == MAP_FAILED){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  if(huge){
+    //Trim the mapping to start at a huge page boundary
+    char* start = (char*)(((unsigned long)mem + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE);
+    char* end = start + ((sz + SMALL_PAGE_SIZE - 1) & -SMALL_PAGE_SIZE);
+    if(start > mem)
+      munmap(mem, start - mem);
+    if(mem + len > end)
+      munmap(end, mem + len - end);
+    mem = start;
+    madvise(mem, sz, MADV_HUGEPAGE);
+  }
+  if(prefault && !(flags & MAP_NORESERVE))
+    touch_pages(mem, sz);
+  return mem;
+}
+
+//Gives the pages of a space that holds no objects back to the OS. They
+//read as zeroes when the space is used again.
+void release_memory (char* mem, long sz) {
+  if(release_idle)
+    madvise(mem, sz, MADV_DONTNEED);
+}
+
 //======== CODE BUFFER ===============
 char* code;
 char* codep;
 int code_cap;
 
+//When profiling, op_map records the opcode at every instruction
+//position in the code buffer. See the PROFILER section.
+int profiling;
+char* op_map;
+void** profile_patch;
+
 void init_codebuffer () {
-  code_cap = 1024 * 1024;
-  code = malloc(code_cap);
+  code_cap = huge_pages? HUGE_PAGE_SIZE : 1024 * 1024;
+  code = map_memory(code_cap, 0);
   codep = code;
+  if(profiling)
+    op_map = calloc(code_cap, 1);
 }
 
 void ensure_code_space () {
   int code_size = codep - code;
   if(code_size + 2*sizeof(long) > code_cap){
     int new_cap = code_size * 2 + 2*sizeof(long);
-    char* buf = malloc(new_cap);
+    char* buf = map_memory(new_cap, 0);
     memcpy(buf, code, code_size);
-    free(code);
+    munmap(code, code_cap);
     code = buf;
+    if(op_map){
+      char* map = calloc(new_cap, 1);
+      memcpy(map, op_map, code_size);
+      free(op_map);
+      op_map = map;
+    }
     code_cap = new_cap;
     codep = code + code_size;
   }
@@ -71,9 +188,30 @@ void write_ptr (void* ptr) {
   codep += sizeof(void*);
 }
 
+#ifdef THREADED_DISPATCH
+//op_handlers[NUM_OPS] is the handler that counts executed
+//instructions. When profiling, every instruction dispatches to it.
+void** op_handlers;
+
+void write_op (int op) {
+  if(profiling){
+    ensure_code_space();
+    align_ptr();
+    op_map[codep - code] = op;
+    write_ptr(op_handlers[NUM_OPS]);
+  }else{
+    write_ptr(op_handlers[op]);
+  }
+}
+#else
+void write_op (int op) {
+  write_char(op);
+}
+#endif
+
 void write_frame (MethodValue* v) {
   ensure_code_space();
-  write_char(FRAME_INS);
+  write_op(FRAME_INS);
   write_char(v->nargs);
   write_short(v->nlocals);
 }
@@ -97,9 +235,11 @@ typedef struct {
 } Patch;
 
 Vector* patches;
+Vector* caches;
 
 void init_patchbuffer () {
   patches = make_vector();
+  caches = make_vector();
 }
 
 void write_class_arity (int class) {
@@ -141,6 +281,13 @@ void write_global_idx (char* name) {
   write_short(0);
 }
 
+void write_inline_cache () {
+  align_ptr();
+  vector_add(caches, (void*)(codep - code));
+  for(int i=0; i<sizeof(InlineCache)/sizeof(void*); i++)
+    write_ptr(0);
+}
+
 void write_label (char* name) {
   align_ptr();
   Patch* p = malloc(sizeof(Patch));
@@ -278,12 +425,50 @@ int get_global_idx (char* name) {
   exit(-1);
 }
 
+//========== SYMBOLS ===========
+Vector* symbols;
+
+int intern (char* name) {
+  for(int i=0; i<symbols->size; i++){
+    char* sname = vector_get(symbols, i);
+    if(strcmp(sname, name) == 0)
+      return i;
+  }
+  vector_add(symbols, name);
+  return symbols->size - 1;
+}
+
+char* symbol_name (int sym) {
+  return vector_get(symbols, sym);
+}
+
+void init_symbols () {
+  symbols = make_vector();
+  intern("eq");
+  intern("lt");
+  intern("le");
+  intern("gt");
+  intern("ge");
+  intern("add");
+  intern("sub");
+  intern("mul");
+  intern("div");
+  intern("mod");
+  intern("get");
+  intern("set");
+  intern("length");
+}
+
 //========== LINKER =============
 char* link_str (Vector* values, int idx) {
   StringValue* v = vector_get(values, idx);
   return v->value;
 }
 
+int link_sym (Vector* values, int idx) {
+  return intern(link_str(values, idx));
+}
+
 void print_code_buffer () {
   for(long* cp = (long*)code; cp < (long*)(codep + 8); cp += 1){
     printf("0x%lx: %016lx\n", (long)cp, cp[0]);
@@ -301,10 +486,10 @@ void link_ins (Vector* values, ByteIns* ins) {
     LitIns* ins2 = (LitIns*)ins;
     Value* v = vector_get(values, ins2->idx);
     if(v->tag == INT_VAL){
-      write_char(INT_INS);
+      write_op(INT_INS);
       write_int(((IntValue*)v)->value);
     }else if(v->tag == NULL_VAL){
-      write_char(NULL_INS);
+      write_op(NULL_INS);
     }else{
       printf("Unrecognized Literal: %d\n", v->tag);
       exit(-1);
@@ -313,96 +498,721 @@ void link_ins (Vector* values, ByteIns* ins) {
   }
   case PRINTF_OP:{
     PrintfIns* ins2 = (PrintfIns*)ins;
-    write_char(PRINTF_INS);
+    write_op(PRINTF_INS);
     write_char(ins2->arity);
     write_ptr(link_str(values, ins2->format));
     break;
   }
   case ARRAY_OP:{
-    write_char(ARRAY_INS);
+    write_op(ARRAY_INS);
     break;
   }
   case OBJECT_OP:{
     ObjectIns* ins2 = (ObjectIns*)ins;
-    write_char(OBJECT_INS);
+    write_op(OBJECT_INS);
     write_class_arity(ins2->class);
     write_class_tag(ins2->class);
     break;
   }
   case SLOT_OP:{
     SlotIns* ins2 = (SlotIns*)ins;
-    write_char(SLOT_INS);
-    write_ptr(link_str(values, ins2->name));
+    write_op(SLOT_INS);
+    write_int(link_sym(values, ins2->name));
+    write_inline_cache();
     break;
   }
   case SET_SLOT_OP:{
     SetSlotIns* ins2 = (SetSlotIns*)ins;
-    write_char(SET_SLOT_INS);
-    write_ptr(link_str(values, ins2->name));
+    write_op(SET_SLOT_INS);
+    write_int(link_sym(values, ins2->name));
+    write_inline_cache();
     break;
   }
   case CALL_SLOT_OP:{
     CallSlotIns* ins2 = (CallSlotIns*)ins;
-    write_char(CALL_SLOT_INS);
+    write_op(CALL_SLOT_INS);
     write_char(ins2->arity);
-    write_ptr(link_str(values, ins2->name));
+    write_int(link_sym(values, ins2->name));
+    write_inline_cache();
     break;
   }
   case CALL_OP:{
     CallIns* ins2 = (CallIns*)ins;
-    write_char(CALL_INS);
+    write_op(CALL_INS);
     write_char(ins2->arity);
     write_function_ptr(link_str(values, ins2->name));
     break;
   }
   case SET_LOCAL_OP:{
     SetLocalIns* ins2 = (SetLocalIns*)ins;
-    write_char(SET_LOCAL_INS);
+    write_op(SET_LOCAL_INS);
     write_short(ins2->idx);
     break;
   }
   case GET_LOCAL_OP:{
     GetLocalIns* ins2 = (GetLocalIns*)ins;
-    write_char(GET_LOCAL_INS);
+    write_op(GET_LOCAL_INS);
     write_short(ins2->idx);
     break;
   }
   case SET_GLOBAL_OP:{
     SetGlobalIns* ins2 = (SetGlobalIns*)ins;
-    write_char(SET_GLOBAL_INS);
+    write_op(SET_GLOBAL_INS);
     write_global_idx(link_str(values, ins2->name));
     break;
   }
   case GET_GLOBAL_OP:{
     GetGlobalIns* ins2 = (GetGlobalIns*)ins;
-    write_char(GET_GLOBAL_INS);
+    write_op(GET_GLOBAL_INS);
     write_global_idx(link_str(values, ins2->name));
     break;
   }
   case BRANCH_OP:{
     BranchIns* ins2 = (BranchIns*)ins;
-    write_char(BRANCH_INS);
+    write_op(BRANCH_INS);
     write_label(link_str(values, ins2->name));
     break;
   }
   case GOTO_OP:{
     GotoIns* ins2 = (GotoIns*)ins;
-    write_char(GOTO_INS);
+    write_op(GOTO_INS);
     write_label(link_str(values, ins2->name));
     break;
   }
   case RETURN_OP:{
-    write_char(RETURN_INS);
+    write_op(RETURN_INS);
+    break;
+  }
+  case DROP_OP:{
+    write_op(DROP_INS);
+    break;
+  }
+  default:
+    printf("Unknown instruction: %d\n", ins->tag);
+    exit(-1);
+  }
+}
+
+//======= SUPERINSTRUCTIONS ==========
+//Common instruction sequences are fused into superinstructions as the
+//code is linked. CMP_BRANCH_SUPER is applied at runtime instead, when
+//an Int comparison followed by a branch is quickened.
+typedef enum {
+  GET_LOCAL2_SUPER,
+  GET_LOCAL_INT_SUPER,
+  SET_LOCAL_DROP_SUPER,
+  SET_GLOBAL_DROP_SUPER,
+  CMP_BRANCH_SUPER,
+  NUM_SUPERS
+} SuperTag;
+
+char* super_names[] = {
+  "get-local2",
+  "get-local-int",
+  "set-local-drop",
+  "set-global-drop",
+  "cmp-branch"
+};
+
+int super_enabled[NUM_SUPERS];
+
+char* opt_super;
+char* opt_super_profile;
+
+//A superinstruction is selected from a profile if the instruction
+//pairs it replaces make up at least this percentage of all executed
+//pairs.
+#define SUPER_THRESHOLD_PERCENT 1
+
+int super_tag (char* name) {
+  for(int i=0; i<NUM_SUPERS; i++)
+    if(strcmp(super_names[i], name) == 0)
+      return i;
+  printf("Unknown superinstruction: %s\n", name);
+  exit(-1);
+}
+
+int super_matches (int super, int op1, int op2) {
+  switch(super){
+  case GET_LOCAL2_SUPER:
+    return op1 == GET_LOCAL_INS && op2 == GET_LOCAL_INS;
+  case GET_LOCAL_INT_SUPER:
+    return op1 == GET_LOCAL_INS && op2 == INT_INS;
+  case SET_LOCAL_DROP_SUPER:
+    return op1 == SET_LOCAL_INS && op2 == DROP_INS;
+  case SET_GLOBAL_DROP_SUPER:
+    return op1 == SET_GLOBAL_INS && op2 == DROP_INS;
+  case CMP_BRANCH_SUPER:
+    return op1 >= INT_EQ_INS && op1 <= INT_GE_INS && op2 == BRANCH_INS;
+  default:
+    return 0;
+  }
+}
+
+//Reads a profile written with -pairprofile. Each line holds two
+//opcodes and the number of times the second executed right after the
+//first.
+void select_supers_from_profile (char* filename) {
+  FILE* f = fopen(filename, "r");
+  if(!f){
+    printf("Could not read file %s.\n", filename);
+    exit(-1);
+  }
+  long counts[NUM_SUPERS];
+  memset(counts, 0, sizeof(counts));
+  long total = 0;
+  int op1, op2;
+  long count;
+  while(fscanf(f, "%d %d %ld%*[^\n]", &op1, &op2, &count) == 3){
+    total += count;
+    for(int i=0; i<NUM_SUPERS; i++)
+      if(super_matches(i, op1, op2))
+        counts[i] += count;
+  }
+  fclose(f);
+  for(int i=0; i<NUM_SUPERS; i++)
+    super_enabled[i] = total > 0 && counts[i] * 100 >= total * SUPER_THRESHOLD_PERCENT;
+}
+
+void init_supers () {
+  for(int i=0; i<NUM_SUPERS; i++)
+    super_enabled[i] = !opt_pair_profile;
+  if(opt_super){
+    for(int i=0; i<NUM_SUPERS; i++)
+      super_enabled[i] = 0;
+    char* list = strdup(opt_super);
+    for(char* name = strtok(list, ","); name; name = strtok(0, ","))
+      if(strcmp(name, "none") != 0)
+        super_enabled[super_tag(name)] = 1;
+    free(list);
+  }
+  if(opt_super_profile)
+    select_supers_from_profile(opt_super_profile);
+}
+
+//Links a superinstruction starting at instruction i of the method
+//body, and returns the number of instructions that were fused. Returns
+//0 if no enabled superinstruction applies.
+int link_super (Vector* values, Vector* body, int i) {
+  if(i + 1 >= body->size)
+    return 0;
+  ByteIns* ins1 = vector_get(body, i);
+  ByteIns* ins2 = vector_get(body, i + 1);
+  if(ins1->tag == GET_LOCAL_OP && ins2->tag == GET_LOCAL_OP &&
+     super_enabled[GET_LOCAL2_SUPER]){
+    write_op(GET_LOCAL2_INS);
+    write_short(((GetLocalIns*)ins1)->idx);
+    write_short(((GetLocalIns*)ins2)->idx);
+    return 2;
+  }
+  if(ins1->tag == GET_LOCAL_OP && ins2->tag == LIT_OP &&
+     super_enabled[GET_LOCAL_INT_SUPER]){
+    Value* v = vector_get(values, ((LitIns*)ins2)->idx);
+    if(v->tag == INT_VAL){
+      write_op(GET_LOCAL_INT_INS);
+      write_short(((GetLocalIns*)ins1)->idx);
+      write_int(((IntValue*)v)->value);
+      return 2;
+    }
+  }
+  if(ins1->tag == SET_LOCAL_OP && ins2->tag == DROP_OP &&
+     super_enabled[SET_LOCAL_DROP_SUPER]){
+    write_op(SET_LOCAL_DROP_INS);
+    write_short(((SetLocalIns*)ins1)->idx);
+    return 2;
+  }
+  if(ins1->tag == SET_GLOBAL_OP && ins2->tag == DROP_OP &&
+     super_enabled[SET_GLOBAL_DROP_SUPER]){
+    write_op(SET_GLOBAL_DROP_INS);
+    write_global_idx(link_str(values, ((SetGlobalIns*)ins1)->name));
+    return 2;
+  }
+  return 0;
+}
+
+//======= REGISTER TRANSLATION =======
+//Translates the stack instructions of a method into register
+//instructions. The operand stack is simulated while linking: each
+//entry is either a register or a pending Int literal. Locals are pushed
+//without copying them, and every other value at stack position p
+//lives in the temporary register TEMP(p). At labels and branches the
+//stack is flushed so that every entry is in its temporary.
+
+int opt_regs;
+
+typedef enum {
+  REG_ENTRY,
+  INT_ENTRY
+} EntryTag;
+
+typedef struct {
+  EntryTag tag;
+  int value;
+} Entry;
+
+typedef struct {
+  char* name;
+  int depth;
+} LabelDepth;
+
+Entry* rstack;
+int rdepth;
+int rstack_cap;
+int max_rdepth;
+int ntemps_base;
+int reachable;
+Vector* label_depths;
+
+//The last instruction written, its position in the code buffer, and
+//the position of its destination register or -1.
+int last_reg_op;
+int last_reg_op_pos;
+int last_reg_dst_pos;
+
+#define TEMP(p) (ntemps_base + (p))
+
+void begin_reg_ins (int op) {
+  ensure_code_space();
+#ifdef THREADED_DISPATCH
+  align_ptr();
+#endif
+  last_reg_op = op;
+  last_reg_op_pos = codep - code;
+  last_reg_dst_pos = -1;
+  write_op(op);
+}
+
+void write_dst (int r) {
+  ensure_code_space();
+  align_short();
+  last_reg_dst_pos = codep - code;
+  write_short(r);
+}
+
+void rpush (EntryTag tag, int value) {
+  if(rdepth == rstack_cap){
+    rstack_cap = rstack_cap * 2 + 16;
+    rstack = realloc(rstack, sizeof(Entry) * rstack_cap);
+  }
+  rstack[rdepth].tag = tag;
+  rstack[rdepth].value = value;
+  rdepth++;
+  if(rdepth > max_rdepth)
+    max_rdepth = rdepth;
+}
+
+//Pushes a value held in register r. Temporaries must stay at their
+//own stack position.
+void rpush_reg (int r) {
+  if(r >= ntemps_base && r != TEMP(rdepth)){
+    begin_reg_ins(REG_MOV_INS);
+    write_dst(TEMP(rdepth));
+    write_short(r);
+    r = TEMP(rdepth);
+  }
+  rpush(REG_ENTRY, r);
+}
+
+//Returns the register holding the entry at stack position p.
+int reg_operand (int p) {
+  Entry* e = &rstack[p];
+  if(e->tag == INT_ENTRY){
+    begin_reg_ins(REG_INT_INS);
+    write_dst(TEMP(p));
+    write_int(e->value);
+    e->tag = REG_ENTRY;
+    e->value = TEMP(p);
+  }
+  return e->value;
+}
+
+//Moves the entry at stack position p into its temporary.
+void flush_entry (int p) {
+  int r = reg_operand(p);
+  if(r != TEMP(p)){
+    begin_reg_ins(REG_MOV_INS);
+    write_dst(TEMP(p));
+    write_short(r);
+    rstack[p].value = TEMP(p);
+  }
+}
+
+void flush_rstack () {
+  for(int i=0; i<rdepth; i++)
+    flush_entry(i);
+}
+
+void set_label_depth (char* name, int depth) {
+  for(int i=0; i<label_depths->size; i++){
+    LabelDepth* l = vector_get(label_depths, i);
+    if(strcmp(l->name, name) == 0){
+      if(l->depth != depth){
+        printf("Inconsistent stack depth at label %s.\n", name);
+        exit(-1);
+      }
+      return;
+    }
+  }
+  LabelDepth* l = malloc(sizeof(LabelDepth));
+  l->name = name;
+  l->depth = depth;
+  vector_add(label_depths, l);
+}
+
+//Returns the recorded stack depth at a label, or -1.
+int get_label_depth (char* name) {
+  for(int i=0; i<label_depths->size; i++){
+    LabelDepth* l = vector_get(label_depths, i);
+    if(strcmp(l->name, name) == 0)
+      return l->depth;
+  }
+  return -1;
+}
+
+int is_int_sym (int name) {
+  return name >= EQ_SYM && name <= MOD_SYM;
+}
+
+int is_compare_sym (int name) {
+  return name >= EQ_SYM && name <= GE_SYM;
+}
+
+int class_nvars (Vector* values, int class) {
+  ClassValue* c = vector_get(values, class);
+  int nvars = 0;
+  for(int i=0; i<c->slots->size; i++){
+    Value* v = vector_get(values, (int)vector_get(c->slots, i));
+    if(v->tag == SLOT_VAL)
+      nvars++;
+  }
+  return nvars;
+}
+
+//Pops n entries and writes their registers.
+void write_reg_args (int n) {
+  int base = rdepth - n;
+  for(int i=0; i<n; i++)
+    reg_operand(base + i);
+  for(int i=0; i<n; i++)
+    write_short(rstack[base + i].value);
+  rdepth = base;
+}
+
+//Links a builtin Int slot call x.name(y). If the next instruction
+//branches on a comparison, it is linked together with the branch and
+//1 is returned.
+int link_reg_int_op (Vector* values, int name, ByteIns* next) {
+  int p = rdepth - 2;
+  int x = reg_operand(p);
+  Entry y = rstack[p + 1];
+  int op = name - EQ_SYM;
+  if(is_compare_sym(name) && next && next->tag == BRANCH_OP){
+    rdepth = p;
+    flush_rstack();
+    char* label = link_str(values, ((BranchIns*)next)->name);
+    set_label_depth(label, rdepth);
+    if(y.tag == INT_ENTRY){
+      begin_reg_ins(REG_EQ_IMM_BRANCH_INS + op);
+      write_short(x);
+      write_int(y.value);
+    }else{
+      begin_reg_ins(REG_EQ_BRANCH_INS + op);
+      write_short(x);
+      write_short(y.value);
+    }
+    begin_reg_ins(REG_BRANCH_INS);
+    write_short(TEMP(p));
+    write_label(label);
+    return 1;
+  }
+  if(y.tag == INT_ENTRY){
+    begin_reg_ins(REG_EQ_IMM_INS + op);
+    write_dst(TEMP(p));
+    write_short(x);
+    write_int(y.value);
+  }else{
+    begin_reg_ins(REG_EQ_INS + op);
+    write_dst(TEMP(p));
+    write_short(x);
+    write_short(y.value);
+  }
+  rdepth = p;
+  rpush(REG_ENTRY, TEMP(p));
+  return 0;
+}
+
+void link_reg_call_slot (Vector* values, CallSlotIns* ins) {
+  int name = link_sym(values, ins->name);
+  int n = ins->arity;
+  int p = rdepth - n;
+  if((name == GET_SYM && n == 2) || (name == SET_SYM && n == 3) ||
+     (name == LENGTH_SYM && n == 1)){
+    for(int i=0; i<n; i++)
+      reg_operand(p + i);
+    begin_reg_ins(name == GET_SYM? REG_ARRAY_GET_INS :
+                  name == SET_SYM? REG_ARRAY_SET_INS : REG_ARRAY_LENGTH_INS);
+    write_dst(TEMP(p));
+    write_reg_args(n);
+  }else{
+    for(int i=0; i<n; i++)
+      reg_operand(p + i);
+    begin_reg_ins(REG_CALL_SLOT_INS);
+    write_char(n);
+    write_dst(TEMP(p));
+    write_int(name);
+    write_inline_cache();
+    write_reg_args(n);
+  }
+  rpush(REG_ENTRY, TEMP(p));
+}
+
+//Links the stack instruction at index i of body, and returns the
+//number of instructions that were consumed.
+int link_reg_ins (Vector* values, Vector* body, int i) {
+  ByteIns* ins = vector_get(body, i);
+  ByteIns* next = i + 1 < body->size? vector_get(body, i + 1) : 0;
+  switch(ins->tag){
+  case LABEL_OP:{
+    LabelIns* ins2 = (LabelIns*)ins;
+    char* name = link_str(values, ins2->name);
+    if(reachable){
+      flush_rstack();
+      set_label_depth(name, rdepth);
+    }else{
+      int depth = get_label_depth(name);
+      if(depth >= 0)
+        rdepth = depth;
+      else
+        set_label_depth(name, rdepth);
+      for(int i=0; i<rdepth; i++){
+        rstack[i].tag = REG_ENTRY;
+        rstack[i].value = TEMP(i);
+      }
+    }
+    set_label(name);
+    last_reg_dst_pos = -1;
+    reachable = 1;
+    break;
+  }
+  case LIT_OP:{
+    LitIns* ins2 = (LitIns*)ins;
+    Value* v = vector_get(values, ins2->idx);
+    if(v->tag == INT_VAL){
+      rpush(INT_ENTRY, ((IntValue*)v)->value);
+    }else if(v->tag == NULL_VAL){
+      begin_reg_ins(REG_NULL_INS);
+      write_dst(TEMP(rdepth));
+      rpush(REG_ENTRY, TEMP(rdepth));
+    }else{
+      printf("Unrecognized Literal: %d\n", v->tag);
+      exit(-1);
+    }
+    break;
+  }
+  case PRINTF_OP:{
+    PrintfIns* ins2 = (PrintfIns*)ins;
+    int p = rdepth - ins2->arity;
+    for(int i=p; i<rdepth; i++)
+      reg_operand(i);
+    begin_reg_ins(REG_PRINTF_INS);
+    write_char(ins2->arity);
+    write_dst(TEMP(p));
+    write_ptr(link_str(values, ins2->format));
+    write_reg_args(ins2->arity);
+    rpush(REG_ENTRY, TEMP(p));
+    break;
+  }
+  case ARRAY_OP:{
+    int p = rdepth - 2;
+    reg_operand(p);
+    reg_operand(p + 1);
+    begin_reg_ins(REG_ARRAY_INS);
+    write_dst(TEMP(p));
+    write_reg_args(2);
+    rpush(REG_ENTRY, TEMP(p));
+    break;
+  }
+  case OBJECT_OP:{
+    ObjectIns* ins2 = (ObjectIns*)ins;
+    int arity = class_nvars(values, ins2->class);
+    int p = rdepth - arity - 1;
+    for(int i=p; i<rdepth; i++)
+      reg_operand(i);
+    begin_reg_ins(REG_OBJECT_INS);
+    write_char(arity);
+    write_class_tag(ins2->class);
+    write_dst(TEMP(p));
+    write_reg_args(arity + 1);
+    rpush(REG_ENTRY, TEMP(p));
+    break;
+  }
+  case SLOT_OP:{
+    SlotIns* ins2 = (SlotIns*)ins;
+    int p = rdepth - 1;
+    int obj = reg_operand(p);
+    begin_reg_ins(REG_SLOT_INS);
+    write_dst(TEMP(p));
+    write_short(obj);
+    write_int(link_sym(values, ins2->name));
+    write_inline_cache();
+    rdepth = p;
+    rpush(REG_ENTRY, TEMP(p));
+    break;
+  }
+  case SET_SLOT_OP:{
+    SetSlotIns* ins2 = (SetSlotIns*)ins;
+    int p = rdepth - 2;
+    int obj = reg_operand(p);
+    int x = reg_operand(p + 1);
+    begin_reg_ins(REG_SET_SLOT_INS);
+    write_short(obj);
+    write_short(x);
+    write_int(link_sym(values, ins2->name));
+    write_inline_cache();
+    rdepth = p;
+    if(next && next->tag == DROP_OP)
+      return 2;
+    rpush_reg(x);
+    break;
+  }
+  case CALL_SLOT_OP:{
+    CallSlotIns* ins2 = (CallSlotIns*)ins;
+    int name = link_sym(values, ins2->name);
+    if(ins2->arity == 2 && is_int_sym(name))
+      return 1 + link_reg_int_op(values, name, next);
+    link_reg_call_slot(values, ins2);
+    break;
+  }
+  case CALL_OP:{
+    CallIns* ins2 = (CallIns*)ins;
+    int p = rdepth - ins2->arity;
+    for(int i=p; i<rdepth; i++)
+      reg_operand(i);
+    begin_reg_ins(REG_CALL_INS);
+    write_char(ins2->arity);
+    write_dst(TEMP(p));
+    write_function_ptr(link_str(values, ins2->name));
+    write_reg_args(ins2->arity);
+    rpush(REG_ENTRY, TEMP(p));
+    break;
+  }
+  case SET_LOCAL_OP:{
+    SetLocalIns* ins2 = (SetLocalIns*)ins;
+    int local = ins2->idx;
+    int top = rdepth - 1;
+    //Copy out any pending reads of the local before it is overwritten
+    int moved = 0;
+    for(int i=0; i<top; i++){
+      if(rstack[i].tag == REG_ENTRY && rstack[i].value == local){
+        flush_entry(i);
+        moved = 1;
+      }
+    }
+    Entry* e = &rstack[top];
+    if(e->tag == INT_ENTRY){
+      begin_reg_ins(REG_INT_INS);
+      write_dst(local);
+      write_int(e->value);
+    }else if(e->value != local){
+      //Retarget the instruction that computed the value
+      if(!moved && e->value == TEMP(top) && last_reg_dst_pos >= 0 &&
+         ((short*)(code + last_reg_dst_pos))[0] == TEMP(top)){
+        ((short*)(code + last_reg_dst_pos))[0] = local;
+        e->value = local;
+      }else{
+        begin_reg_ins(REG_MOV_INS);
+        write_dst(local);
+        write_short(e->value);
+      }
+    }
+    break;
+  }
+  case GET_LOCAL_OP:{
+    GetLocalIns* ins2 = (GetLocalIns*)ins;
+    rpush(REG_ENTRY, ins2->idx);
+    break;
+  }
+  case SET_GLOBAL_OP:{
+    SetGlobalIns* ins2 = (SetGlobalIns*)ins;
+    int x = reg_operand(rdepth - 1);
+    begin_reg_ins(REG_SET_GLOBAL_INS);
+    write_global_idx(link_str(values, ins2->name));
+    write_short(x);
+    break;
+  }
+  case GET_GLOBAL_OP:{
+    GetGlobalIns* ins2 = (GetGlobalIns*)ins;
+    begin_reg_ins(REG_GET_GLOBAL_INS);
+    write_dst(TEMP(rdepth));
+    write_global_idx(link_str(values, ins2->name));
+    rpush(REG_ENTRY, TEMP(rdepth));
+    break;
+  }
+  case BRANCH_OP:{
+    BranchIns* ins2 = (BranchIns*)ins;
+    char* label = link_str(values, ins2->name);
+    int x = reg_operand(rdepth - 1);
+    rdepth--;
+    flush_rstack();
+    set_label_depth(label, rdepth);
+    begin_reg_ins(REG_BRANCH_INS);
+    write_short(x);
+    write_label(label);
+    break;
+  }
+  case GOTO_OP:{
+    GotoIns* ins2 = (GotoIns*)ins;
+    char* label = link_str(values, ins2->name);
+    flush_rstack();
+    set_label_depth(label, rdepth);
+    begin_reg_ins(REG_GOTO_INS);
+    write_label(label);
+    reachable = 0;
+    break;
+  }
+  case RETURN_OP:{
+    int x = reg_operand(rdepth - 1);
+    begin_reg_ins(REG_RETURN_INS);
+    write_short(x);
+    rdepth--;
+    reachable = 0;
     break;
   }
   case DROP_OP:{
-    write_char(DROP_INS);
+    //Drop the instruction that computed the value if it has no other
+    //effect
+    int top = rdepth - 1;
+    if(rstack[top].tag == REG_ENTRY && rstack[top].value == TEMP(top) &&
+       last_reg_dst_pos >= 0 &&
+       (last_reg_op == REG_MOV_INS || last_reg_op == REG_INT_INS || last_reg_op == REG_NULL_INS) &&
+       ((short*)(code + last_reg_dst_pos))[0] == TEMP(top)){
+      codep = code + last_reg_op_pos;
+      last_reg_dst_pos = -1;
+    }
+    rdepth--;
     break;
   }
   default:
     printf("Unknown instruction: %d\n", ins->tag);
     exit(-1);
   }
+  return 1;
+}
+
+void link_reg_method (Vector* values, MethodValue* v) {
+  ntemps_base = v->nargs + v->nlocals;
+  rdepth = 0;
+  max_rdepth = 0;
+  reachable = 1;
+  label_depths = make_vector();
+  begin_reg_ins(REG_FRAME_INS);
+  write_char(v->nargs);
+  align_short();
+  int nregs_pos = codep - code;
+  write_short(0);
+  for(int i=0; i<v->code->size; )
+    i += link_reg_ins(values, v->code, i);
+  ((short*)(code + nregs_pos))[0] = ntemps_base + max_rdepth;
 }
 
 //=========== CLASSES =============
@@ -421,6 +1231,42 @@ void init_classes () {
   vector_add(classes, 0);
 }
 
+int hash_sym (int sym) {
+  return (int)(((unsigned int)sym * 2654435761u) >> 8);
+}
+
+//The table is kept at most half full. If a name appears twice, the
+//first slot wins, as in a linear search.
+void make_slot_table (LClass* c) {
+  int sz = 2;
+  while(sz < 2 * c->nslots)
+    sz *= 2;
+  c->table_mask = sz - 1;
+  c->table = malloc(sizeof(int) * sz);
+  for(int i=0; i<sz; i++)
+    c->table[i] = -1;
+  for(int i=0; i<c->nslots; i++){
+    int name = c->slots[i].name;
+    int h = hash_sym(name) & c->table_mask;
+    while(c->table[h] >= 0 && c->slots[c->table[h]].name != name)
+      h = (h + 1) & c->table_mask;
+    if(c->table[h] < 0)
+      c->table[h] = i;
+  }
+}
+
+LSlot* find_slot (LClass* c, int name) {
+  int h = hash_sym(name) & c->table_mask;
+  while(1){
+    int i = c->table[h];
+    if(i < 0)
+      return 0;
+    if(c->slots[i].name == name)
+      return &c->slots[i];
+    h = (h + 1) & c->table_mask;
+  }
+}
+
 int make_class (Vector* values, ClassValue* class) {
   //Link
   int nvars = 0;
@@ -433,7 +1279,7 @@ int make_class (Vector* values, ClassValue* class) {
     case SLOT_VAL:{
       SlotValue* v2 = (SlotValue*)v;
       slots[i].tag = VAR_SLOT;
-      slots[i].name = link_str(values, v2->name);
+      slots[i].name = link_sym(values, v2->name);
       slots[i].idx = nvars;
       nvars++;
       break;
@@ -441,7 +1287,7 @@ int make_class (Vector* values, ClassValue* class) {
     case METHOD_VAL:{
       MethodValue* v2 = (MethodValue*)v;
       slots[i].tag = CODE_SLOT;
-      slots[i].name = link_str(values, v2->name);
+      slots[i].name = link_sym(values, v2->name);
       slots[i].code = get_method_label(vidx);
       break;
     }
@@ -457,6 +1303,7 @@ int make_class (Vector* values, ClassValue* class) {
   c->nvars = nvars;
   c->nslots = nslots;
   c->slots = slots;
+  make_slot_table(c);
   vector_add(classes, c);
   
   //Return class index
@@ -464,24 +1311,54 @@ int make_class (Vector* values, ClassValue* class) {
 }
 
 char* link_program (Program* prog) {
+  if(opt_regs && (opt_pair_profile || opt_super_profile || opt_disasm || opt_profile || opt_trace_calls)){
+    printf("Register code does not support -pairprofile, -superprofile, -disasm, -profile or -tracecalls.\n");
+    exit(-1);
+  }
+#ifdef THREADED_DISPATCH
+  op_handlers = opt_regs? reg_loop(1) : run_loop(1);
+#endif
+  profiling = opt_pair_profile || opt_profile || opt_trace_calls;
+  init_supers();
+  init_backing();
   init_codebuffer();
   init_patchbuffer();
   init_tablebuffer();
   init_globals();
+  init_symbols();
   init_classes();
   
   //Link code
+  double start = now_ms();
   for(int i=0; i<prog->values->size; i++){
     MethodValue* v = vector_get(prog->values, i);
     if(v->tag == METHOD_VAL){
       set_method_label(i);
+      if(opt_profile || opt_sample || opt_trace_calls)
+        add_profile_method(v, link_str(prog->values, v->name), i);
+      if(opt_regs){
+        link_reg_method(prog->values, v);
+        continue;
+      }
       write_frame(v);
-      for(int i=0; i<v->code->size; i++)
-        link_ins(prog->values, vector_get(v->code, i));      
+      for(int i=0; i<v->code->size; ){
+        long pos = codep - code;
+        int n = link_super(prog->values, v->code, i);
+        if(n == 0){
+          link_ins(prog->values, vector_get(v->code, i));
+          n = 1;
+        }
+        if(opt_profile)
+          set_profile_pos(i, n, pos);
+        i += n;
+      }
     }
   }
 
+  trace_phase("link code", "startup", start);
+
   //Link Classes
+  start = now_ms();
   for(int i=0; i<prog->values->size; i++){
     ClassValue* v = vector_get(prog->values, i);
     if(v->tag == CLASS_VAL){
@@ -490,7 +1367,10 @@ char* link_program (Program* prog) {
     }
   }
 
+  trace_phase("link classes", "startup", start);
+
   //Link Globals
+  start = now_ms();
   for(int i=0; i<prog->slots->size; i++){
     int idx = (int)vector_get(prog->slots, i);
     Value* v = vector_get(prog->values, idx);
@@ -506,7 +1386,10 @@ char* link_program (Program* prog) {
     }
   }
 
+  trace_phase("link globals", "startup", start);
+
   //Run Patches
+  start = now_ms();
   for(int i=0; i<patches->size; i++){
     Patch* p = vector_get(patches, i);
     switch(p->type){
@@ -542,6 +1425,8 @@ char* link_program (Program* prog) {
     }
   }
 
+  trace_phase("link patches", "startup", start);
+
   //Return Entry
   return get_method_label(prog->entry);
 }
@@ -551,97 +1436,742 @@ char* link_program (Program* prog) {
 //===================== INTERPRETER ==========================
 //============================================================
 
-typedef struct {
-  long tag;
-  long value;
-} VMInt;
+//Integers are not allocated on the heap. They are stored directly
+//in the pointer as a tagged immediate: the value is shifted left by
+//one and the low bit is set. Heap objects are always aligned to 8
+//bytes so their low bit is always clear.
+#define INT_TAG 1
+#define is_int(o) (((long)(o)) & INT_TAG)
+#define unbox_int(o) ((int)(((long)(o)) >> 1))
+
+//Compile with -DCOMPACT_HEAP for compact objects: the header is a 4
+//byte tag, followed by a 4 byte length in arrays, and fields hold 32
+//bit references. The whole heap is mapped below 2GB with MAP_32BIT, so
+//a reference is the low half of a pointer, and decode_ref gets the
+//pointer back by sign extending it. Ints become 31 bits wide so that
+//they are sign extended in the same way. Values outside the heap, in
+//the stacks, registers and globals, are still full pointers. Objects
+//are padded to a multiple of 8 bytes, and the smallest ones take 8
+//bytes instead of 16. Linux only has 1GB to offer to MAP_32BIT, so the
+//semispaces are limited to 256MB by default.
+#ifdef COMPACT_HEAP
+#ifndef MAP_32BIT
+#error "COMPACT_HEAP needs mmap with MAP_32BIT."
+#endif
+typedef int Header;
+typedef unsigned int Ref;
+#define box_int(i) ((void*)(long)(int)((((unsigned int)(i)) << 1) | INT_TAG))
+#define decode_ref(r) ((void*)(long)(int)(r))
+#define encode_ref(x) ((Ref)(long)(x))
+#define HEAP_MAP_FLAGS MAP_32BIT
+#define MIN_OBJ_SHIFT 3
+#define DEFAULT_HEAP_MAX (256L * 1024 * 1024)
+#else
+typedef long Header;
+typedef void* Ref;
+#define box_int(i) ((void*)((((unsigned long)(long)(i)) << 1) | INT_TAG))
+#define decode_ref(r) (r)
+#define encode_ref(x) (x)
+#define HEAP_MAP_FLAGS 0
+#define MIN_OBJ_SHIFT 4
+#define DEFAULT_HEAP_MAX (1024L * 1024 * 1024)
+#endif
 
 typedef struct {
-  long tag;
-  long scratch;
+  Header tag;
+  Header scratch;
 } VMNull;
 
 typedef struct {
-  long tag;
-  void* parent;
-  void* slots[];
+  Header tag;
+  Ref parent;
+  Ref slots[];
 } VMObj;
 
 typedef struct {
-  long tag;
-  long length;
-  void* items[];
+  Header tag;
+  Header length;
+  Ref items[];
 } VMArray;
 
-LSlot lookup_method (VMObj* obj, char* name);
-LSlot lookup_varslot (VMObj* obj, char* name);
-void call_array_slot (char* slotname, int n);
-void call_int_slot (char* slotname, int n);
+#define obj_size(nvars) ((sizeof(VMObj) + sizeof(Ref) * (long)(nvars) + 7) & -8L)
+#define array_size(length) ((sizeof(VMArray) + sizeof(Ref) * (long)(length) + 7) & -8L)
+
+LSlot lookup_method (VMObj* obj, int name, int* depth);
+LSlot lookup_varslot (VMObj* obj, int name, int* depth);
+typedef struct {
+  long hits;
+  long misses;
+} ICStats;
+
+ICStats ic_stats[FRAME_INS + 1];
+void init_method_cache ();
+LSlot lookup_slot (VMObj* obj, int name, int* depth);
+LSlot cached_lookup_slot (VMObj* obj, int name, int* depth);
+LSlot* ic_lookup (InlineCache* ic, VMObj* obj);
+void ic_update (InlineCache* ic, VMObj* obj, LSlot s, int depth);
+void print_ic_stats ();
+void count_op (char* p, int op);
+void profile_op ();
+void init_profile ();
+void print_profile ();
+void start_sampling ();
+void stop_sampling ();
+void perf_sample ();
+void print_perf ();
+void write_samples (char* filename);
+void write_pair_profile (char* filename);
+void call_array_slot (int slotname, int n);
+void push_int (int r);
+void call_int_slot (int slotname, int n);
 void run_gc ();
+void minor_gc ();
+void major_gc (long reserve);
+void reserve_par_space ();
+void* replicate_ptr (void* ptr);
+void log_write (void* o);
+void incremental_gc (int sz);
+void init_incremental ();
+void init_pretenuring ();
+void decide_pretenuring ();
+void print_pretenured_sites ();
+void* immix_alloc (int sz);
+void* mark_ptr (void* ptr);
+void immix_gc ();
+void init_immix ();
+void remember (void* o);
+void par_collect ();
+void init_gc_threads ();
+void print_gc_stats ();
 void print_obj (VMObj* obj);
 
-int heap_sz;
+//heap_mem is the semispace being allocated into, and free_mem is the
+//other one. They can have different sizes while the heap is being
+//resized: heap_sz is the size that free_mem should have at the next
+//collection.
+long heap_sz;
 char* heap_mem;
+long heap_mem_sz;
 char* heap_top;
 char* heap_ptr;
 char* free_mem;
+long free_sz;
+
+//Set while the incremental collector is building replicas.
+int replicating;
 
 char* ip;
-int fp;
 int n;
-Vector* vstack;
-Vector* fstack;
 void** genv;
 VMNull* nullobj;
-VMInt* zeroobj;
 
+//======= HEAP SIZING ========
+//Each semispace starts at heap_init bytes. After a collection the heap
+//doubles if more than heap_grow percent of the semispace survived, and
+//halves after SHRINK_GCS collections in a row in which less than
+//heap_shrink percent survived. It stays between heap_init and
+//heap_max. The settings come from the -heapinit and -heapmax options
+//or from the FEENY_HEAP_INIT, FEENY_HEAP_MAX, FEENY_HEAP_GROW and
+//FEENY_HEAP_SHRINK environment variables.
+#define SHRINK_GCS 4
+
+//The incremental collector starts a cycle once INC_TRIGGER percent of
+//the semispace is used, so its survival rate is measured against that.
+#define INC_TRIGGER 50
+
+char* opt_heap_init;
+char* opt_heap_max;
+long heap_init;
+long heap_max;
+int heap_grow;
+int heap_shrink;
+int low_gcs;
+
+//Parses a size in bytes with an optional k, m or g suffix.
+long parse_size (char* str) {
+  char* end;
+  long sz = strtol(str, &end, 10);
+  switch(*end){
+  case 'k': case 'K': sz <<= 10; end++; break;
+  case 'm': case 'M': sz <<= 20; end++; break;
+  case 'g': case 'G': sz <<= 30; end++; break;
+  }
+  if(end == str || *end != 0 || sz <= 0){
+    printf("Invalid size: %s\n", str);
+    exit(-1);
+  }
+  return sz;
+}
+
+long heap_setting (char* opt, char* env, long def) {
+  if(!opt)
+    opt = getenv(env);
+  return opt? parse_size(opt) : def;
+}
+
+char* alloc_space (long sz) {
+  return map_memory(sz, HEAP_MAP_FLAGS);
+}
+
+//Gives free_mem the size heap_sz. It holds no objects, so its old
+//memory is returned to the OS.
+void resize_free_space () {
+  if(free_sz != heap_sz){
+    munmap(free_mem, free_sz);
+    free_mem = alloc_space(heap_sz);
+    free_sz = heap_sz;
+  }
+}
+
+//Called after each collection to pick the size of the next semispace.
+//Live large objects count towards the survival rate, since they are
+//scanned by every collection too.
+long large_bytes;
+
+void adapt_heap () {
+  long live = heap_ptr - heap_mem;
+  long survival = (live + large_bytes) * 100 / heap_mem_sz;
+  if(opt_incremental)
+    survival = survival * 100 / INC_TRIGGER;
+  if(survival > heap_grow){
+    low_gcs = 0;
+    if(heap_sz < heap_max)
+      heap_sz = heap_sz * 2 < heap_max? heap_sz * 2 : heap_max;
+  }else if(survival < heap_shrink){
+    low_gcs++;
+    if(low_gcs >= SHRINK_GCS && heap_sz / 2 >= heap_init && heap_sz / 2 >= live * 2){
+      low_gcs = 0;
+      heap_sz /= 2;
+    }
+  }else{
+    low_gcs = 0;
+  }
+  resize_free_space();
+}
+
+//Grows the heap so that it has room for needed bytes, and collects into
+//the larger semispace.
+void grow_heap (long needed) {
+  long sz = heap_sz;
+  while(sz < needed * 2)
+    sz *= 2;
+  if(sz > heap_max)
+    sz = heap_max;
+  if(sz < needed){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  heap_sz = sz;
+  resize_free_space();
+  run_gc();
+}
+
+//With -immix the semispaces are not used, and init_immix sets up the
+//heap instead.
 void init_heap () {
-  heap_sz = 1024 * 16;
-  heap_mem = malloc(heap_sz);
-  free_mem = malloc(heap_sz);
+  heap_init = heap_setting(opt_heap_init, "FEENY_HEAP_INIT", 1024 * 1024);
+  heap_max = heap_setting(opt_heap_max, "FEENY_HEAP_MAX", DEFAULT_HEAP_MAX);
+  heap_grow = getenv("FEENY_HEAP_GROW")? atoi(getenv("FEENY_HEAP_GROW")) : 50;
+  heap_shrink = getenv("FEENY_HEAP_SHRINK")? atoi(getenv("FEENY_HEAP_SHRINK")) : 10;
+  if(heap_max < heap_init)
+    heap_max = heap_init;
+  heap_sz = heap_init;
+  if(opt_immix)
+    return;
+  heap_mem = alloc_space(heap_sz);
+  heap_mem_sz = heap_sz;
+  free_mem = alloc_space(heap_sz);
+  free_sz = heap_sz;
   heap_ptr = heap_mem;
   heap_top = heap_mem + heap_sz;
 }
 
+//======= LARGE OBJECTS ========
+//Arrays of at least large_array_length items are not allocated in the
+//semispaces. Each one gets its own mmap'd region, headed by a
+//LargeObj, and is never moved. A collection marks the large arrays it
+//reaches in place, scans them from gray_large, and then unmaps the
+//ones that were not marked. Since smaller arrays are never large
+//objects, an array is a large object exactly if its length is at least
+//large_array_length.
+//
+//Allocating more than heap_mem_sz bytes of large arrays since the
+//last collection starts a new one. The threshold comes from the
+//-largearray option or FEENY_LARGE_ARRAY, in bytes.
+typedef struct LargeObj {
+  struct LargeObj* next;
+  long size;
+  int marked;
+  int remembered;
+} LargeObj;
+
+char* opt_large_array;
+long large_array_length;
+LargeObj* large_objs;
+long large_bytes_since_gc;
+Vector* gray_large;
+
+#define is_large(o) (((VMArray*)(o))->tag == ARRAY_CLASS_TAG && \
+                     ((VMArray*)(o))->length >= large_array_length)
+#define large_header(o) ((LargeObj*)(o) - 1)
+
+void init_large_objs () {
+  long sz = heap_setting(opt_large_array, "FEENY_LARGE_ARRAY", 32 * 1024);
+  large_array_length = (sz - sizeof(VMArray) + sizeof(Ref) - 1) / sizeof(Ref);
+  if(large_array_length < 1)
+    large_array_length = 1;
+  gray_large = make_vector();
+}
+
+//Marks a reachable large array, and queues it to be scanned the first
+//time.
+void mark_large (void* o) {
+  LargeObj* h = large_header(o);
+  if(!h->marked){
+    h->marked = 1;
+    vector_add(gray_large, o);
+  }
+}
+
+//Unmaps the large arrays that were not marked, and unmarks the rest.
+void sweep_large () {
+  LargeObj** link = &large_objs;
+  while(*link){
+    LargeObj* h = *link;
+    if(h->marked){
+      h->marked = 0;
+      link = &h->next;
+    }else{
+      *link = h->next;
+      large_bytes -= h->size;
+      munmap(h, h->size);
+    }
+  }
+  large_bytes_since_gc = 0;
+}
+
+//Collects once enough large arrays were allocated to be worth it.
+void collect_for_large () {
+  if(opt_gen)
+    major_gc(0);
+  else if(opt_incremental)
+    incremental_gc(0);
+  else if(opt_immix)
+    immix_gc();
+  else
+    run_gc();
+}
+
+VMArray* alloc_large_array (int length) {
+  long sz = sizeof(LargeObj) + array_size(length);
+  large_bytes_since_gc += sz;
+  if(large_bytes_since_gc > heap_mem_sz)
+    collect_for_large();
+  if(large_bytes + sz > heap_max){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  LargeObj* h = (LargeObj*)alloc_space(sz);
+  h->next = large_objs;
+  h->size = sz;
+  large_objs = h;
+  large_bytes += sz;
+  VMArray* a = (VMArray*)(h + 1);
+  a->tag = ARRAY_CLASS_TAG;
+  a->length = length;
+  //Its items are initialized without a write barrier
+  if(opt_gen)
+    remember(a);
+  return a;
+}
+
+//======= GENERATIONS ========
+//With -gen, objects are allocated in a nursery of nursery_sz bytes
+//and heap_ptr and heap_top bump through the nursery instead. The
+//semispaces become the tenured space, which is filled from
+//tenure_ptr. A minor collection copies the live nursery objects into
+//the tenured space, so every object that survives one collection is
+//tenured. When the tenured space is full, a major collection copies
+//both generations into the other semispace with run_gc.
+//
+//Minor collections only scan the stacks, the remembered globals and
+//the remembered objects. The write barrier remembers a tenured object
+//the first time a nursery pointer is stored into it. remembered_bits
+//has a bit for each word of the tenured space so that an object is
+//only added to remset once. Globals are remembered in the same way
+//with one byte each.
+int opt_gen;
+char* opt_nursery;
+char* opt_incremental;
+char* nursery;
+long nursery_sz;
+char* tenure_ptr;
+char* tenure_top;
+int collecting_nursery;
+unsigned char* remembered_bits;
+Vector* remset;
+char* remembered_globals;
+Vector* global_remset;
+
+#define is_young(o) (!is_int(o) && (unsigned long)((char*)(o) - nursery) < nursery_sz)
+//The barriers also keep the replicas of the incremental collector up
+//to date. See INCREMENTAL COLLECTOR.
+#define write_barrier(o, x) do{ \
+    if(is_young(x) && !is_young(o)) remember(o); \
+    if(replicating) log_write(o); \
+  }while(0)
+#define global_barrier(idx, x) do{ \
+    if(is_young(x) && !remembered_globals[idx]) remember_global(idx); \
+    if(replicating) replicate_ptr(x); \
+  }while(0)
+
+void remember (void* o) {
+  if(is_large(o)){
+    if(!large_header(o)->remembered){
+      large_header(o)->remembered = 1;
+      vector_add(remset, o);
+    }
+    return;
+  }
+  long word = ((char*)o - heap_mem) >> 3;
+  unsigned char bit = 1 << (word & 7);
+  if(!(remembered_bits[word >> 3] & bit)){
+    remembered_bits[word >> 3] |= bit;
+    vector_add(remset, o);
+  }
+}
+
+void remember_global (int idx) {
+  remembered_globals[idx] = 1;
+  vector_add(global_remset, (void*)(long)idx);
+}
+
+//Empties the remembered set of objects, and resizes the bitmap to
+//cover heap_mem.
+void clear_remset () {
+  remembered_bits = realloc(remembered_bits, heap_mem_sz / 64 + 1);
+  memset(remembered_bits, 0, heap_mem_sz / 64 + 1);
+  vector_clear(remset);
+}
+
+void init_generations () {
+  nursery_sz = heap_setting(opt_nursery, "FEENY_NURSERY", 256 * 1024);
+  nursery = alloc_space(nursery_sz);
+  tenure_ptr = heap_mem;
+  tenure_top = heap_mem + heap_mem_sz;
+  heap_ptr = nursery;
+  heap_top = nursery + nursery_sz;
+  remset = make_vector();
+  remembered_bits = 0;
+  clear_remset();
+  remembered_globals = calloc(globals->size + 1, 1);
+  global_remset = make_vector();
+  init_pretenuring();
+}
+
+//Objects that are too large for the nursery are allocated directly in
+//the tenured space. They are remembered immediately because their
+//fields are initialized without a write barrier.
+void* alloc_tenured (long tag, int sz) {
+  if(tenure_ptr + sz > tenure_top)
+    major_gc(sz);
+  Header* obj = (Header*)tenure_ptr;
+  obj[0] = tag;
+  tenure_ptr += sz;
+  remember(obj);
+  return obj;
+}
+
 void* halloc (long tag, int sz) {
   if(heap_ptr + sz > heap_top){
-    run_gc();
-    if(heap_ptr + sz > heap_top){
-      printf("Out of Memory.\n");
-      exit(-1);
+    if(opt_gen){
+      minor_gc();
+      if(sz > nursery_sz)
+        return alloc_tenured(tag, sz);
+    }else if(opt_incremental){
+      incremental_gc(sz);
+    }else if(opt_immix){
+      Header* obj = immix_alloc(sz);
+      obj[0] = tag;
+      return obj;
+    }else{
+      run_gc();
+      if(heap_ptr + sz > heap_top)
+        grow_heap(heap_ptr - heap_mem + sz);
     }
   }
-  long* obj = (long*)heap_ptr;
+  Header* obj = (Header*)heap_ptr;
   obj[0] = tag;
   heap_ptr += sz;
   return obj;
 }
 
-VMNull* alloc_null () {
-  return halloc(NULL_CLASS_TAG, sizeof(VMNull));
+//======= PRETENURING ========
+//With -gen, the survival rate of the objects allocated by each OBJECT
+//or ARRAY instruction is tracked. Each nursery object has an entry in
+//nursery_sites, one per 16 bytes (8 with COMPACT_HEAP) since that is
+//the smallest object size, which holds the index of its site in sites. Index 0 stands for
+//objects without a site. Minor collections count the objects they
+//tenure per site. After each one, a site is pretenured if at least
+//pretenure_rate percent of its objects survived, out of at least
+//PRETENURE_MIN. Its objects are then allocated directly in the tenured
+//space, except for one in PRETENURE_SAMPLE that is still allocated in
+//the nursery. If less than pretenure_rate percent of the last
+//PRETENURE_MIN / PRETENURE_SAMPLE of those survive, the site is no
+//longer pretenured. This catches sites that are shared by long and
+//short lived objects, such as the constructor of a list node.
+//
+//Sites are looked up by the address of their instruction in the code
+//buffer, whose offset is what -disasm prints. The rate comes from the
+//-pretenure option or FEENY_PRETENURE, and 0 turns pretenuring off.
+#define PRETENURE_MIN 256
+#define PRETENURE_SAMPLE 16
+
+#ifdef THREADED_DISPATCH
+#define OP_WIDTH sizeof(void*)
+#else
+#define OP_WIDTH 1
+#endif
+
+typedef struct {
+  char* addr;
+  long tag;
+  //Objects allocated in the nursery, and how many of them were
+  //tenured, since the site was last checked and before that
+  long allocated;
+  long survived;
+  long old_allocated;
+  long old_survived;
+  //Objects allocated directly in the tenured space
+  long pretenured;
+  int skipped;
+  int pretenuring;
+  int times_pretenured;
+} AllocSite;
+
+char* opt_pretenure;
+int pretenure_rate;
+AllocSite* sites;
+long nsites;
+long sites_cap;
+long* site_table;
+long site_table_mask;
+int* nursery_sites;
+
+void init_pretenuring () {
+  char* rate = opt_pretenure? opt_pretenure : getenv("FEENY_PRETENURE");
+  pretenure_rate = rate? atoi(rate) : 90;
+  if(pretenure_rate < 0 || pretenure_rate > 100){
+    printf("Invalid pretenuring rate: %s\n", rate);
+    exit(-1);
+  }
+  sites_cap = 64;
+  sites = calloc(sites_cap, sizeof(AllocSite));
+  nsites = 1;
+  site_table_mask = 127;
+  site_table = calloc(site_table_mask + 1, sizeof(long));
+  nursery_sites = calloc(nursery_sz >> MIN_OBJ_SHIFT, sizeof(int));
 }
 
-VMInt* alloc_int (int value) {
-  VMInt* i = halloc(INT_CLASS_TAG, sizeof(VMInt));
-  i->value = value;
+void add_site_entry (long i) {
+  long j = ((long)sites[i].addr >> 3) & site_table_mask;
+  while(site_table[j])
+    j = (j + 1) & site_table_mask;
+  site_table[j] = i;
+}
+
+//Adds the site at addr, whose entry in site_table should be j.
+long add_site (char* addr, long tag, long j) {
+  if(nsites == sites_cap){
+    sites = realloc(sites, sizeof(AllocSite) * sites_cap * 2);
+    memset(sites + sites_cap, 0, sizeof(AllocSite) * sites_cap);
+    sites_cap *= 2;
+  }
+  long i = nsites++;
+  sites[i].addr = addr;
+  sites[i].tag = tag;
+  if(nsites * 2 > site_table_mask){
+    site_table_mask = site_table_mask * 2 + 1;
+    site_table = realloc(site_table, sizeof(long) * (site_table_mask + 1));
+    memset(site_table, 0, sizeof(long) * (site_table_mask + 1));
+    for(long k=1; k<nsites; k++)
+      add_site_entry(k);
+  }else{
+    site_table[j] = i;
+  }
   return i;
 }
 
-VMArray* alloc_empty_array (int length) {
-  VMArray* o = halloc(ARRAY_CLASS_TAG, sizeof(VMArray) + sizeof(void*) * length);
+//Returns the index of the site at addr, adding it the first time.
+long site_index (char* addr, long tag) {
+  long j = ((long)addr >> 3) & site_table_mask;
+  while(site_table[j]){
+    if(sites[site_table[j]].addr == addr)
+      return site_table[j];
+    j = (j + 1) & site_table_mask;
+  }
+  return add_site(addr, tag, j);
+}
+
+//Allocates an object for the instruction at site, which is 0 for
+//objects allocated by the runtime.
+void* alloc_at (char* site, long tag, int sz) {
+  if(!opt_gen || !pretenure_rate)
+    return halloc(tag, sz);
+  long i = site? site_index(site, tag) : 0;
+  if(sites[i].pretenuring && ++sites[i].skipped < PRETENURE_SAMPLE){
+    sites[i].pretenured++;
+    return alloc_tenured(tag, sz);
+  }
+  sites[i].skipped = 0;
+  void* obj = halloc(tag, sz);
+  if(is_young(obj)){
+    nursery_sites[((char*)obj - nursery) >> MIN_OBJ_SHIFT] = i;
+    sites[i].allocated++;
+  }
+  return obj;
+}
+
+//Called at the end of a minor collection.
+void decide_pretenuring () {
+  for(long i=1; i<nsites; i++){
+    AllocSite* s = &sites[i];
+    long needed = s->pretenuring? PRETENURE_MIN / PRETENURE_SAMPLE : PRETENURE_MIN;
+    if(s->allocated < needed)
+      continue;
+    int survives = s->survived * 100 >= s->allocated * pretenure_rate;
+    if(survives != s->pretenuring){
+      s->pretenuring = survives;
+      s->times_pretenured += survives;
+    }else if(!s->pretenuring){
+      continue;
+    }
+    s->old_allocated += s->allocated;
+    s->old_survived += s->survived;
+    s->allocated = 0;
+    s->survived = 0;
+  }
+}
+
+//Lists the sites that were pretenured, for -gcstats.
+void print_pretenured_sites () {
+  long n = 0;
+  for(long i=1; i<nsites; i++)
+    n += sites[i].times_pretenured > 0;
+  printf("   pretenured sites: %ld of %ld\n", n, nsites - 1);
+  for(long i=1; i<nsites; i++){
+    AllocSite* s = &sites[i];
+    if(!s->times_pretenured)
+      continue;
+    long allocated = s->allocated + s->old_allocated;
+    long survived = s->survived + s->old_survived;
+    printf("      %ld: ", (long)(s->addr - code));
+    if(s->tag == ARRAY_CLASS_TAG)
+      printf("array");
+    else
+      printf("object class:%ld", s->tag);
+    printf(", %ld of %ld survived, pretenured %d times, %ld allocated tenured\n",
+           survived, allocated, s->times_pretenured, s->pretenured);
+  }
+}
+
+VMNull* alloc_null () {
+  return halloc(NULL_CLASS_TAG, sizeof(VMNull));
+}
+
+VMArray* alloc_empty_array (char* site, int length) {
+  if(length >= large_array_length)
+    return alloc_large_array(length);
+  VMArray* o = alloc_at(site, ARRAY_CLASS_TAG, array_size(length));
   o->length = length;
   return o;
 }
 
 VMArray* alloc_array (int length, void* x) {
-  VMArray* o = alloc_empty_array(length);
+  VMArray* o = alloc_empty_array(0, length);
   for(int i=0; i<length; i++)
-    o->items[i] = x;
+    o->items[i] = encode_ref(x);
   return o;
 }
 
-VMObj* alloc_object (int class, int nslots) {
-  return halloc(class, sizeof(VMObj) + sizeof(void*) * nslots);
+VMObj* alloc_object (char* site, int class, int nslots) {
+  return alloc_at(site, class, obj_size(nslots));
+}
+
+//============================================================
+//======================= STACKS =============================
+//============================================================
+
+//The operand stack (vstack) and the frame stack (fstack) are
+//preallocated regions of STACK_SLOTS values each, followed by an
+//inaccessible guard page. vsp and fsp point one past the topmost
+//value. A push past the end of either stack faults on the guard page
+//instead of being bounds checked.
+//
+//A frame starts at fp and holds:
+//   fp[0]: return address
+//   fp[1]: caller's fp
+//   fp[2...]: arguments followed by locals
+#define STACK_SLOTS (1024 * 1024)
+
+void** vstack;
+void** vsp;
+void** fstack;
+void** fsp;
+void** fp;
+char* vstack_guard;
+char* fstack_guard;
+long guard_sz;
+
+#define vpush(x) (*vsp++ = (x))
+#define vpop() (*--vsp)
+#define vpeek() (vsp[-1])
+
+void* alloc_stack (char** guard) {
+  long sz = sizeof(void*) * STACK_SLOTS;
+  char* mem = mmap(0, sz + guard_sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED){
+    printf("Could not allocate stack.\n");
+    exit(-1);
+  }
+  *guard = mem + sz;
+  mprotect(*guard, guard_sz, PROT_NONE);
+  return mem;
+}
+
+int in_guard (char* addr, char* guard) {
+  return addr >= guard && addr < guard + guard_sz;
+}
+
+//Faults on a guard page are reported as a stack overflow. The VM
+//exits immediately, so printf is safe enough here. Any other fault is
+//handed back to the default handler.
+void handle_segv (int sig, siginfo_t* info, void* context) {
+  char* addr = info->si_addr;
+  if(in_guard(addr, vstack_guard)){
+    printf("Operand stack overflow.\n");
+    exit(-1);
+  }
+  if(in_guard(addr, fstack_guard)){
+    printf("Frame stack overflow.\n");
+    exit(-1);
+  }
+  signal(SIGSEGV, SIG_DFL);
+}
+
+void init_stacks () {
+  guard_sz = sysconf(_SC_PAGESIZE);
+  vstack = alloc_stack(&vstack_guard);
+  fstack = alloc_stack(&fstack_guard);
+  vsp = vstack;
+  fsp = fstack;
+  
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handle_segv;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, 0);
 }
 
 //============================================================
@@ -649,85 +2179,112 @@ VMObj* alloc_object (int class, int nslots) {
 //============================================================
 
 typedef struct {
-  long tag;
-  void* forward;
+  Header tag;
+  Ref forward;
 } BrokenHeart;
 
 void* make_forward (void* src, void* dst) {
   BrokenHeart* bh = (BrokenHeart*)src;
   bh->tag = -1;
-  bh->forward = dst;
+  bh->forward = encode_ref(dst);
   return dst;
 }
 
-int sizeof_obj (VMObj* o) {
-  if(o->tag == NULL_CLASS_TAG)
+long obj_tag (void* o) {
+  if(is_int(o))
+    return INT_CLASS_TAG;
+  return ((VMObj*)o)->tag;
+}
+
+//The size of o if it has the given tag. The parallel collector calls
+//this after replacing the tag of o.
+int sizeof_tagged_obj (long tag, VMObj* o) {
+  if(tag == NULL_CLASS_TAG)
     return sizeof(VMNull);
-  else if(o->tag == INT_CLASS_TAG)
-    return sizeof(VMInt);
-  else if(o->tag == ARRAY_CLASS_TAG){
+  else if(tag == ARRAY_CLASS_TAG){
     VMArray* a = (VMArray*)o;
-    return sizeof(VMArray) + sizeof(void*) * a->length;
+    return array_size(a->length);
   }
   else{
-    LClass* c = vector_get(classes, o->tag);
-    return sizeof(VMObj) + sizeof(void*) * c->nvars;
+    LClass* c = vector_get(classes, tag);
+    return obj_size(c->nvars);
   }
 }
 
+int sizeof_obj (VMObj* o) {
+  return sizeof_tagged_obj(o->tag, o);
+}
+
+//During a minor collection only nursery objects are copied, and
+//heap_ptr points into the tenured space. At the end of an incremental
+//cycle objects are replicated instead, and with -immix they are
+//marked.
 void* link_ptr (void* ptr) {
-  long tag = ((long*)ptr)[0];
+  if(is_int(ptr) || (collecting_nursery && !is_young(ptr)))
+    return ptr;
+  if(replicating)
+    return replicate_ptr(ptr);
+  if(opt_immix)
+    return mark_ptr(ptr);
+  long tag = ((Header*)ptr)[0];
   if(tag == -1){
     BrokenHeart* bh = (BrokenHeart*)ptr;
-    return bh->forward;
+    return decode_ref(bh->forward);
+  }else if(is_large(ptr)){
+    mark_large(ptr);
+    return ptr;
   }else{
     void* dst = heap_ptr;
     int sz = sizeof_obj((VMObj*)ptr);
     memcpy(dst, ptr, sz);
     heap_ptr += sz;
+    if(collecting_nursery)
+      sites[nursery_sites[((char*)ptr - nursery) >> MIN_OBJ_SHIFT]].survived++;
     return make_forward(ptr, dst);
   }
 }
 
+void link_field (Ref* f) {
+  *f = encode_ref(link_ptr(decode_ref(*f)));
+}
+
 void scan_obj (VMObj* o) {
   LClass* c = vector_get(classes, o->tag);
-  o->parent = link_ptr(o->parent);
+  link_field(&o->parent);
   for(int i=0; i<c->nvars; i++)
-    o->slots[i] = link_ptr(o->slots[i]);
+    link_field(&o->slots[i]);
 }
 
 void scan_array (VMArray* o) {
   for(int i=0; i<o->length; i++)
-    o->items[i] = link_ptr(o->items[i]);
+    link_field(&o->items[i]);
 }
 
 void* scan_next (char* ptr) {
-  long tag = ((long*)ptr)[0];
+  long tag = ((Header*)ptr)[0];
   if(tag == ARRAY_CLASS_TAG)
     scan_array((VMArray*)ptr);
-  else if(tag != INT_CLASS_TAG && tag != NULL_CLASS_TAG)
+  else if(tag != NULL_CLASS_TAG)
     scan_obj((VMObj*)ptr);
   return ptr + sizeof_obj((VMObj*)ptr);
 }
 
 void scan_fstack () {
-  int frame_top = fstack->size;
-  int frame_bot = fp;
-  while(frame_top > 0){
-    for(int i = frame_bot+2; i<frame_top; i++){
-      void* o = link_ptr(vector_get(fstack, i));
-      vector_set(fstack, i, o);
-    }
+  void** frame_top = fsp;
+  void** frame_bot = fp;
+  while(frame_top > fstack){
+    for(void** p = frame_bot + 2; p < frame_top; p++)
+      *p = link_ptr(*p);
     frame_top = frame_bot;
-    frame_bot = (int)vector_get(fstack, frame_bot + 1);
+    frame_bot = frame_bot[1];
   }
 }
 
+//With TOS_CACHE, the cached top of stack is always spilled onto
+//vstack before anything is allocated, so it is scanned here too.
 void scan_vstack () {
-  for(int i=0; i<vstack->size; i++){
-    void* o = link_ptr(vector_get(vstack, i));
-    vector_set(vstack, i, o);
-  }
+  for(void** p = vstack; p < vsp; p++)
+    *p = link_ptr(*p);
 }
 
 void scan_globals () {
@@ -735,451 +2292,3653 @@ void scan_globals () {
     genv[i] = link_ptr(genv[i]);
 }
 
-void run_gc () {
-  //Flip flop heap
-  char* swap = heap_mem;
-  heap_mem = free_mem;
-  free_mem = swap;
-  heap_ptr = heap_mem;
-  heap_top = heap_ptr + heap_sz;
-    
-  //Scan roots
-  scan_globals();
-  scan_fstack();
-  scan_vstack();
-  nullobj = link_ptr(nullobj);
-  zeroobj = link_ptr(zeroobj);
+//-gcstats prints the number of collections, the distribution of their
+//pauses and the share of the run time spent in them on exit.
+//
+//Every pause is recorded as a GCEvent. The collector fills in the
+//kind and byte counts of the current pause in gc_event, and
+//record_pause adds the timing and the roots. With -gclog <file>, or
+//FEENY_GC_LOG, each event is also written to the file as a line of
+//JSON, followed by a summary line at exit.
+//- kind: full, major or minor for the copying collectors, slice or
+//  flip for -incremental, and immix.
+//- before: Bytes in use in the collected space, or 0 for slices.
+//- live: Bytes that survived. For a slice, 0.
+//- copied: Bytes copied during the pause. For -immix, the bytes that
+//  were evacuated.
+//- globals, frames, stack: The number of global, frame and operand
+//  stack roots.
+typedef struct {
+  char* kind;
+  double start;
+  double pause;
+  long before;
+  long live;
+  long copied;
+  int globals;
+  int frames;
+  int stack;
+} GCEvent;
 
-  //Scan heap
-  char* p = heap_mem;
-  while(p < heap_ptr)
-    p = scan_next(p);
+int opt_gc_stats;
+char* opt_gc_log;
+FILE* gc_log;
+long gc_count;
+long minor_gc_count;
+double gc_total_ms;
+double vm_start_ms;
+GCEvent gc_event;
+GCEvent* gc_events;
+long ngc_events;
+long gc_events_cap;
 
-  //printf("Garbage Collection\n");
-  //printf("Number of bytes used: %ld\n", heap_ptr - heap_mem);
+//Number of threads used by run_gc. See PARALLEL COLLECTOR.
+char* opt_gc_threads;
+int gc_threads;
+
+double now_ms () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-//============================================================
-//============================================================
-               
+void trace_gc_event (GCEvent* e, double start, double end);
 
-unsigned char next_char () {
-  unsigned char c = ip[0];
-  ip++;
-  return c;
+void init_gc_log () {
+  if(!opt_gc_log)
+    opt_gc_log = getenv("FEENY_GC_LOG");
+  if(!opt_gc_log)
+    return;
+  gc_log = fopen(opt_gc_log, "w");
+  if(!gc_log){
+    printf("Could not open GC log: %s\n", opt_gc_log);
+    exit(-1);
+  }
 }
 
-int next_short () {
-  ip = (char*)(((long)ip + 1)&(-2));
-  int s = ((unsigned short*)ip)[0];  
-  ip += 2;
-  return s;
+void count_roots (GCEvent* e) {
+  e->globals = globals->size;
+  e->frames = 0;
+  void** frame_top = fsp;
+  void** frame_bot = fp;
+  while(frame_top > fstack){
+    e->frames += frame_top - (frame_bot + 2);
+    frame_top = frame_bot;
+    frame_bot = frame_bot[1];
+  }
+  e->stack = vsp - vstack;
 }
 
-int next_int () {
-  ip = (char*)(((long)ip + 3)&(-4));
-  int s = ((int*)ip)[0];  
-  ip += 4;
-  return s;
+void log_gc_event (GCEvent* e) {
+  fprintf(gc_log, "{\"event\": \"gc\", \"pause\": %ld, \"kind\": \"%s\", "
+          "\"time_ms\": %.3f, \"pause_ms\": %.3f, \"before\": %ld, "
+          "\"live\": %ld, \"copied\": %ld, \"survival\": %.4f, "
+          "\"heap\": %ld, \"large\": %ld, "
+          "\"globals\": %d, \"frames\": %d, \"stack\": %d}\n",
+          ngc_events, e->kind, e->start, e->pause, e->before,
+          e->live, e->copied, e->before > 0? (double)e->live / e->before : 0,
+          heap_mem_sz, large_bytes, e->globals, e->frames, e->stack);
 }
 
-void* next_ptr () {
-  ip = (char*)(((long)ip + 7)&(-8));
-  void* s = ((void**)ip)[0];  
-  ip += 8;
-  return s;
+//Called at the start of each pause. Returns the start time to pass to
+//record_pause.
+double begin_pause () {
+  if(opt_perf)
+    perf_phase(PERF_GC);
+  return now_ms();
 }
 
-void initvm (char* entry) {
-  //Initialize State
-  ip = entry;
-  fp = 0;
-  n = 0;
-  vstack = make_vector();
-  fstack = make_vector();
-  genv = malloc(sizeof(void*) * globals->size);
-  init_heap();
-  nullobj = alloc_null();
-  zeroobj = alloc_int(0);
-  
-  //Initialize globals
-  for(int i=0; i<globals->size; i++)
-    genv[i] = nullobj;
+//Called at the end of each pause with the time it started.
+void record_pause (double start) {
+  double end = now_ms();
+  GCEvent* e = &gc_event;
+  e->start = start - vm_start_ms;
+  e->pause = end - start;
+  if(!e->kind)
+    e->kind = "full";
+  count_roots(e);
+  gc_total_ms += e->pause;
+  if(ngc_events == gc_events_cap){
+    gc_events_cap = gc_events_cap * 2 + 64;
+    gc_events = realloc(gc_events, sizeof(GCEvent) * gc_events_cap);
+  }
+  gc_events[ngc_events++] = *e;
+  if(gc_log)
+    log_gc_event(e);
+  trace_gc_event(e, start, end);
+  memset(e, 0, sizeof(GCEvent));
+  if(opt_perf)
+    perf_phase(PERF_RUN);
+}
 
-  //Default Frame
-  vector_add(fstack, 0);
-  vector_add(fstack, 0);
+int compare_doubles (const void* a, const void* b) {
+  double x = *(double*)a;
+  double y = *(double*)b;
+  return (x > y) - (x < y);
 }
 
-void ensure_arity (int actual, int desired) {
-  if(actual != desired){
-    printf("Incorrect arity: Expected %d but received %d.\n", desired, actual);
-    exit(-1);
-  }
+double percentile (double* xs, long n, int p) {
+  if(n == 0)
+    return 0;
+  return xs[(n - 1) * p / 100];
 }
 
-void ensure_parent (VMObj* o) {
-  if(o->tag == INT_CLASS_TAG){
-    printf("Int is not a legal parent.\n");
-    exit(-1);
+//Pauses are counted in buckets that grow by a factor of 10^(1/2), from
+//below 10us to 1s and above.
+#define PAUSE_BUCKETS 12
+
+void print_pause_histogram (double* pauses, long n) {
+  static const double bounds[PAUSE_BUCKETS - 1] =
+    {0.01, 0.0316, 0.1, 0.316, 1, 3.16, 10, 31.6, 100, 316, 1000};
+  long counts[PAUSE_BUCKETS] = {0};
+  long most = 0;
+  for(long i=0, b=0; i<n; i++){
+    while(b < PAUSE_BUCKETS - 1 && pauses[i] >= bounds[b])
+      b++;
+    counts[b]++;
+  }
+  for(int b=0; b<PAUSE_BUCKETS; b++)
+    if(counts[b] > most)
+      most = counts[b];
+  printf("   pause histogram:\n");
+  for(int b=0; b<PAUSE_BUCKETS; b++){
+    if(counts[b] == 0)
+      continue;
+    if(b < PAUSE_BUCKETS - 1)
+      printf("      < %8.3f ms: %8ld ", bounds[b], counts[b]);
+    else
+      printf("      >=%8.3f ms: %8ld ", bounds[b - 1], counts[b]);
+    for(long i=0; i<(counts[b] * 40 + most - 1) / most; i++)
+      printf("#");
+    printf("\n");
   }
-  else if(o->tag == ARRAY_CLASS_TAG){
-    printf("Array is not a legal parent.\n");
-    exit(-1);
-  }  
 }
 
-void ensure_int (VMInt* o) {
-  if(o->tag != INT_CLASS_TAG){
-    printf("Not an integer!\n");
-    exit(-1);
+void print_gc_stats () {
+  double run_ms = now_ms() - vm_start_ms;
+  long n = ngc_events;
+  double* pauses = malloc(sizeof(double) * (n + 1));
+  long before = 0, live = 0, copied = 0, roots = 0;
+  for(long i=0; i<n; i++){
+    GCEvent* e = &gc_events[i];
+    pauses[i] = e->pause;
+    before += e->before;
+    live += e->live;
+    copied += e->copied;
+    roots += e->globals + e->frames + e->stack;
   }
+  qsort(pauses, n, sizeof(double), compare_doubles);
+  printf("Garbage collections: %ld (%ld minor)\n", gc_count, minor_gc_count);
+  printf("   pauses: %ld\n", n);
+  printf("   pause p50/p90/p99/max: %.3f / %.3f / %.3f / %.3f ms\n",
+         percentile(pauses, n, 50), percentile(pauses, n, 90),
+         percentile(pauses, n, 99), percentile(pauses, n, 100));
+  printf("   total pause: %.3f ms of %.3f ms (%.1f%%)\n",
+         gc_total_ms, run_ms, run_ms > 0? 100 * gc_total_ms / run_ms : 0);
+  print_pause_histogram(pauses, n);
+  free(pauses);
+  printf("   bytes copied: %ld\n", copied);
+  printf("   survival: %.1f%%\n", before > 0? 100.0 * live / before : 0);
+  printf("   roots per pause: %.1f\n", n > 0? (double)roots / n : 0);
+  printf("   heap size: %ld bytes\n", heap_mem_sz);
+  printf("   large objects: %ld bytes\n", large_bytes);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("   max resident: %ld kB\n", usage.ru_maxrss);
+  printf("   page faults: %ld\n", usage.ru_minflt + usage.ru_majflt);
+  if(opt_gen && pretenure_rate)
+    print_pretenured_sites();
 }
 
-void ensure_index (VMInt* i, VMArray* a) {
-  ensure_int(i);
-  if(i->value < 0 || i->value >= a->length){
-    printf("Index %d is out of bounds.\n", (int)(i->value));
+void finish_gc_log () {
+  double run_ms = now_ms() - vm_start_ms;
+  fprintf(gc_log, "{\"event\": \"exit\", \"collections\": %ld, \"minor\": %ld, "
+          "\"pauses\": %ld, \"gc_ms\": %.3f, \"run_ms\": %.3f}\n",
+          gc_count, minor_gc_count, ngc_events, gc_total_ms, run_ms);
+  fclose(gc_log);
+}
+
+//With -copyorder depth, the copied objects are scanned in depth first
+//order instead of in the breadth first order of the Cheney scan, so
+//that an object is followed by the objects it references, and lists
+//and trees are laid out in the order they are traversed. Objects that
+//were copied but not scanned are kept on copy_stack as the range of
+//their fields that is left. A range is popped before its last field
+//is followed, so following the tail of a list does not grow the stack.
+//The setting can also come from FEENY_COPY_ORDER.
+char* opt_copy_order;
+int depth_first;
+
+typedef struct {
+  Ref* field;
+  Ref* end;
+} FieldRange;
+
+FieldRange* copy_stack;
+long copy_stack_sz;
+long copy_stack_cap;
+
+void init_copy_order () {
+  char* order = opt_copy_order? opt_copy_order : getenv("FEENY_COPY_ORDER");
+  if(!order || strcmp(order, "breadth") == 0)
+    return;
+  if(strcmp(order, "depth") != 0){
+    printf("Unknown copy order: %s\n", order);
+    exit(-1);
+  }
+  if(gc_threads > 1 || opt_incremental || opt_immix){
+    printf("-copyorder depth cannot be combined with -gcthreads, -incremental or -immix.\n");
     exit(-1);
   }
+  depth_first = 1;
 }
 
-void print_vstack () {
-  printf("[");
-  for(int i=0; i<vstack->size; i++){
-    VMObj* obj = vector_get(vstack, i);
-    if(i > 0) printf(" ");
-    printf("%d", (int)(obj->tag));
+void push_fields (char* o) {
+  long tag = ((Header*)o)[0];
+  FieldRange r;
+  if(tag == NULL_CLASS_TAG){
+    return;
+  }else if(tag == ARRAY_CLASS_TAG){
+    VMArray* a = (VMArray*)o;
+    r.field = a->items;
+    r.end = a->items + a->length;
+  }else{
+    VMObj* obj = (VMObj*)o;
+    LClass* c = vector_get(classes, tag);
+    r.field = &obj->parent;
+    r.end = obj->slots + c->nvars;
   }
-  printf("]\n");
+  if(r.field == r.end)
+    return;
+  if(copy_stack_sz == copy_stack_cap){
+    copy_stack_cap = copy_stack_cap * 2 + 1024;
+    copy_stack = realloc(copy_stack, sizeof(FieldRange) * copy_stack_cap);
+  }
+  copy_stack[copy_stack_sz++] = r;
 }
 
-void print_obj (VMObj* obj) {
-  if(obj->tag == NULL_CLASS_TAG){
-    printf("null");
-  }else if(obj->tag == INT_CLASS_TAG){
-    VMInt* o = (VMInt*)obj;
-    printf("%d", (int)(o->value));
-  }else if(obj->tag == ARRAY_CLASS_TAG){
-    VMArray* o = (VMArray*)obj;
-    printf("[");
-    for(int i=0; i<o->length; i++){
-      if(i > 0) printf(" ");
-      print_obj(o->items[i]);
-    }
-    printf("]");
-  }else{
-    printf("[Object %ld]", obj->tag);
+void scan_depth_first () {
+  while(copy_stack_sz > 0){
+    FieldRange* r = &copy_stack[copy_stack_sz - 1];
+    Ref* f = r->field++;
+    if(r->field == r->end)
+      copy_stack_sz--;
+    char* copy = heap_ptr;
+    link_field(f);
+    if(heap_ptr != copy)
+      push_fields(copy);
   }
 }
 
-void print_format (char* format, int n) {
-  int i = vstack->size - n;
+//Scans the objects that were copied from p onwards, the objects they
+//lead to, and the large objects that were reached.
+void scan_copied (char* p) {
+  if(!depth_first){
+    while(1){
+      while(p < heap_ptr)
+        p = scan_next(p);
+      if(gray_large->size == 0)
+        break;
+      scan_array(vector_pop(gray_large));
+    }
+    return;
+  }
+  //Everything copied after the roots is scanned by scan_depth_first
+  char* end = heap_ptr;
   while(1){
-    char c = format[0];
-    if(c == 0) return;
-    if(c == '~') {
-      print_obj(vector_get(vstack, i));
-      i++;
-    }else{
-      printf("%c", c);
+    while(p < end){
+      push_fields(p);
+      p += sizeof_obj((VMObj*)p);
+      scan_depth_first();
     }
-    format++;    
+    if(gray_large->size == 0)
+      break;
+    push_fields(vector_pop(gray_large));
+    scan_depth_first();
   }
 }
 
-void runvm () {  
-  while(ip){
-    //    printf("IP = 0x%lx\n", ip);
-    //    print_vstack();
-    
-    char tag = next_char();
-    switch(tag){
-    case INT_INS : {
-      int i = next_int();
-      //printf("Run Int(%d)\n", i);
-      VMInt* v = alloc_int(i);
-      vector_add(vstack, v);
-      break;
+void run_gc () {
+  double start = begin_pause();
+  gc_count++;
+  gc_event.kind = opt_gen? "major" : "full";
+  gc_event.before = opt_gen? (tenure_ptr - heap_mem) + (heap_ptr - nursery) : heap_ptr - heap_mem;
+  if(gc_threads > 1)
+    reserve_par_space();
+
+  //Flip flop heap
+  char* swap = heap_mem;
+  heap_mem = free_mem;
+  free_mem = swap;
+  long swap_sz = heap_mem_sz;
+  heap_mem_sz = free_sz;
+  free_sz = swap_sz;
+  heap_ptr = heap_mem;
+  heap_top = heap_ptr + heap_mem_sz;
+    
+  if(gc_threads > 1){
+    par_collect();
+  }else{
+    //Scan roots
+    scan_globals();
+    scan_fstack();
+    scan_vstack();
+    nullobj = link_ptr(nullobj);
+
+    //Scan heap and large objects
+    scan_copied(heap_mem);
+  }
+
+  gc_event.live = gc_event.copied = heap_ptr - heap_mem;
+  sweep_large();
+  adapt_heap();
+  release_memory(free_mem, free_sz);
+  record_pause(start);
+}
+
+void scan_remset () {
+  for(int i=0; i<remset->size; i++)
+    scan_next(vector_get(remset, i));
+  for(int i=0; i<global_remset->size; i++){
+    long idx = (long)vector_get(global_remset, i);
+    genv[idx] = link_ptr(genv[idx]);
+    remembered_globals[idx] = 0;
+  }
+  vector_clear(global_remset);
+}
+
+//Unmarks the remembered objects. All nursery objects are tenured by a
+//minor collection, so nothing needs to stay remembered.
+void forget_remset () {
+  for(int i=0; i<remset->size; i++){
+    void* o = vector_get(remset, i);
+    if(is_large(o)){
+      large_header(o)->remembered = 0;
+      continue;
+    }
+    long word = ((char*)o - heap_mem) >> 3;
+    remembered_bits[word >> 3] = 0;
+  }
+  vector_clear(remset);
+}
+
+void minor_gc () {
+  //Fall back to a major collection if the nursery might not fit
+  if(tenure_top - tenure_ptr < heap_ptr - nursery){
+    major_gc(0);
+    return;
+  }
+  double start = begin_pause();
+
+  //Copy into the tenured space
+  collecting_nursery = 1;
+  gc_event.kind = "minor";
+  gc_event.before = heap_ptr - nursery;
+  char* p = tenure_ptr;
+  heap_ptr = tenure_ptr;
+
+  //Scan roots
+  scan_fstack();
+  scan_vstack();
+  scan_remset();
+  nullobj = link_ptr(nullobj);
+
+  //Scan tenured objects
+  scan_copied(p);
+
+  forget_remset();
+  collecting_nursery = 0;
+  gc_event.live = gc_event.copied = heap_ptr - p;
+  tenure_ptr = heap_ptr;
+  heap_ptr = nursery;
+  heap_top = nursery + nursery_sz;
+  if(pretenure_rate)
+    decide_pretenuring();
+  gc_count++;
+  minor_gc_count++;
+  record_pause(start);
+}
+
+//Collects both generations into the other semispace. It is grown
+//first if needed so that it can hold everything that might be live,
+//plus a full nursery and reserve more bytes.
+void major_gc (long reserve) {
+  long needed = (tenure_ptr - heap_mem) + (heap_ptr - nursery) + nursery_sz + reserve;
+  if(free_sz < needed){
+    while(heap_sz < needed)
+      heap_sz *= 2;
+    resize_free_space();
+  }
+
+  forget_remset();
+  run_gc();
+  tenure_ptr = heap_ptr;
+  tenure_top = heap_mem + heap_mem_sz;
+  if(tenure_ptr - heap_mem + reserve > heap_max){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  heap_ptr = nursery;
+  heap_top = nursery + nursery_sz;
+  clear_remset();
+  for(int i=0; i<global_remset->size; i++)
+    remembered_globals[(long)vector_get(global_remset, i)] = 0;
+  vector_clear(global_remset);
+}
+
+//============================================================
+//================= PARALLEL COLLECTOR =======================
+//============================================================
+
+//With -gcthreads n, run_gc copies the live objects with n threads: the
+//main thread and n-1 workers that sleep between collections. The roots
+//are split into tasks that the threads claim one at a time. Each thread
+//copies into its own buffer (LAB) taken from the to-space, and pushes
+//the objects it copies onto its own work-stealing deque. A thread that
+//runs out of objects to scan steals from the other deques, and the
+//collection ends when every thread is idle at the same time.
+//
+//A thread claims an object by swapping its tag for BUSY_TAG with a
+//compare-and-swap. It then copies the object and turns it into a
+//BrokenHeart. Threads that find a BUSY_TAG wait for the forwarding
+//pointer. Large objects are claimed by a compare-and-swap on their
+//mark instead. Minor collections are still done by the main thread alone.
+#define BUSY_TAG -2
+#define LAB_SIZE (32 * 1024)
+#define LAB_WASTE 256
+#define MAX_GC_THREADS 64
+#define VSTACK_TASK 1024
+
+//Chase-Lev deque. The owner pushes and takes at bottom and thieves
+//steal from top. The item array grows by doubling, and replaced arrays
+//are kept until the end of the collection since thieves may still be
+//reading them.
+typedef struct DequeArray {
+  long size;
+  struct DequeArray* next;
+  void* items[];
+} DequeArray;
+
+typedef struct {
+  long top;
+  long bottom;
+  DequeArray* array;
+  DequeArray* retired;
+} Deque;
+
+typedef struct {
+  Deque deque;
+  char* lab_ptr;
+  char* lab_top;
+  unsigned int seed;
+  pthread_t thread;
+} GCThread;
+
+typedef struct {
+  void** start;
+  void** end;
+} RootTask;
+
+GCThread* gc_thread;
+pthread_barrier_t gc_start;
+pthread_barrier_t gc_done;
+RootTask* root_tasks;
+long nroot_tasks;
+long root_tasks_cap;
+long next_root_task;
+long to_offset;
+int idle_threads;
+
+DequeArray* make_deque_array (long size) {
+  DequeArray* a = malloc(sizeof(DequeArray) + sizeof(void*) * size);
+  a->size = size;
+  a->next = 0;
+  return a;
+}
+
+DequeArray* grow_deque (Deque* d, DequeArray* a, long t, long b) {
+  DequeArray* a2 = make_deque_array(a->size * 2);
+  for(long i=t; i<b; i++)
+    a2->items[i & (a2->size - 1)] = a->items[i & (a->size - 1)];
+  a->next = d->retired;
+  d->retired = a;
+  __atomic_store_n(&d->array, a2, __ATOMIC_RELEASE);
+  return a2;
+}
+
+void deque_push (Deque* d, void* x) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  if(b - t > a->size - 1)
+    a = grow_deque(d, a, t, b);
+  __atomic_store_n(&a->items[b & (a->size - 1)], x, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+void* deque_take (Deque* d) {
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  void* x = 0;
+  if(t <= b){
+    x = __atomic_load_n(&a->items[b & (a->size - 1)], __ATOMIC_RELAXED);
+    if(t == b){
+      //Last item, race against thieves
+      if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        x = 0;
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  }else{
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return x;
+}
+
+void* deque_steal (Deque* d) {
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if(t >= b)
+    return 0;
+  DequeArray* a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+  void* x = __atomic_load_n(&a->items[t & (a->size - 1)], __ATOMIC_RELAXED);
+  if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return 0;
+  return x;
+}
+
+int deque_empty (Deque* d) {
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  return t >= b;
+}
+
+//Turns unused to-space into an array of ints so that the to-space
+//stays a sequence of objects.
+void fill_space (char* p, long sz) {
+  if(sz == 0)
+    return;
+  VMArray* a = (VMArray*)p;
+  a->tag = ARRAY_CLASS_TAG;
+  a->length = (sz - sizeof(VMArray)) / sizeof(Ref);
+  for(int i=0; i<a->length; i++)
+    a->items[i] = encode_ref(box_int(0));
+}
+
+char* shared_alloc (long sz) {
+  long offset = __atomic_fetch_add(&to_offset, sz, __ATOMIC_RELAXED);
+  if(offset + sz > heap_mem_sz){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  return heap_mem + offset;
+}
+
+//Allocates sz bytes of to-space for a thread. A LAB is only retired
+//when less than LAB_WASTE bytes are left in it, and the space left in
+//a LAB is never 8 bytes so that it can always be filled.
+char* par_alloc (GCThread* t, int sz) {
+  long left = t->lab_top - t->lab_ptr;
+  if(left == sz || left >= sz + sizeof(VMNull)){
+    char* p = t->lab_ptr;
+    t->lab_ptr += sz;
+    return p;
+  }
+  if(left >= LAB_WASTE || sz > LAB_SIZE / 4)
+    return shared_alloc(sz);
+  fill_space(t->lab_ptr, left);
+  char* lab = shared_alloc(LAB_SIZE);
+  t->lab_ptr = lab + sz;
+  t->lab_top = lab + LAB_SIZE;
+  return lab;
+}
+
+//Large objects are the only objects outside the spaces being
+//evacuated. This is decided by address and not with is_large, since
+//another thread may overwrite the length of an array with a forwarding
+//pointer at any time.
+int par_is_large (void* ptr) {
+  char* p = ptr;
+  if(p >= free_mem && p < free_mem + free_sz)
+    return 0;
+  if(nursery && p >= nursery && p < nursery + nursery_sz)
+    return 0;
+  return 1;
+}
+
+void* par_link_ptr (GCThread* t, void* ptr) {
+  if(is_int(ptr))
+    return ptr;
+  if(par_is_large(ptr)){
+    int unmarked = 0;
+    if(__atomic_compare_exchange_n(&large_header(ptr)->marked, &unmarked, 1, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      deque_push(&t->deque, ptr);
+    return ptr;
+  }
+  Header* header = (Header*)ptr;
+  Header tag = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+  while(1){
+    if(tag == -1)
+      return decode_ref(((BrokenHeart*)ptr)->forward);
+    if(tag == BUSY_TAG)
+      tag = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+    else if(__atomic_compare_exchange_n(header, &tag, BUSY_TAG, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      break;
+  }
+  int sz = sizeof_tagged_obj(tag, (VMObj*)ptr);
+  Header* dst = (Header*)par_alloc(t, sz);
+  memcpy(dst + 1, header + 1, sz - sizeof(Header));
+  dst[0] = tag;
+  ((BrokenHeart*)ptr)->forward = encode_ref(dst);
+  __atomic_store_n(header, -1, __ATOMIC_RELEASE);
+  if(tag != NULL_CLASS_TAG)
+    deque_push(&t->deque, dst);
+  return dst;
+}
+
+#define par_link_field(t, f) (f) = encode_ref(par_link_ptr(t, decode_ref(f)))
+
+void par_scan (GCThread* t, void* ptr) {
+  long tag = ((Header*)ptr)[0];
+  if(tag == ARRAY_CLASS_TAG){
+    VMArray* a = (VMArray*)ptr;
+    for(int i=0; i<a->length; i++)
+      par_link_field(t, a->items[i]);
+  }else{
+    VMObj* o = (VMObj*)ptr;
+    LClass* c = vector_get(classes, tag);
+    par_link_field(t, o->parent);
+    for(int i=0; i<c->nvars; i++)
+      par_link_field(t, o->slots[i]);
+  }
+}
+
+void* steal_work (GCThread* t) {
+  int self = t - gc_thread;
+  for(int round=0; round<2; round++){
+    int start = rand_r(&t->seed) % gc_threads;
+    for(int i=0; i<gc_threads; i++){
+      int victim = (start + i) % gc_threads;
+      if(victim == self)
+        continue;
+      void* x = deque_steal(&gc_thread[victim].deque);
+      if(x)
+        return x;
+    }
+  }
+  return 0;
+}
+
+//Returns 1 once every thread is idle, or 0 if some deque has work
+//again.
+int wait_idle (GCThread* t) {
+  __atomic_fetch_add(&idle_threads, 1, __ATOMIC_SEQ_CST);
+  while(1){
+    if(__atomic_load_n(&idle_threads, __ATOMIC_SEQ_CST) == gc_threads)
+      return 1;
+    for(int i=0; i<gc_threads; i++){
+      if(!deque_empty(&gc_thread[i].deque)){
+        __atomic_fetch_sub(&idle_threads, 1, __ATOMIC_SEQ_CST);
+        return 0;
+      }
+    }
+    sched_yield();
+  }
+}
+
+void par_work (GCThread* t) {
+  t->lab_ptr = t->lab_top = 0;
+
+  //Scan roots
+  while(1){
+    long i = __atomic_fetch_add(&next_root_task, 1, __ATOMIC_RELAXED);
+    if(i >= nroot_tasks)
+      break;
+    for(void** p = root_tasks[i].start; p < root_tasks[i].end; p++)
+      *p = par_link_ptr(t, *p);
+  }
+
+  //Scan copied objects
+  while(1){
+    void* x;
+    while((x = deque_take(&t->deque)))
+      par_scan(t, x);
+    if((x = steal_work(t)))
+      par_scan(t, x);
+    else if(wait_idle(t))
+      break;
+  }
+
+  fill_space(t->lab_ptr, t->lab_top - t->lab_ptr);
+}
+
+void* gc_worker (void* arg) {
+  GCThread* t = arg;
+  while(1){
+    pthread_barrier_wait(&gc_start);
+    par_work(t);
+    pthread_barrier_wait(&gc_done);
+  }
+  return 0;
+}
+
+void add_root_task (void** start, void** end) {
+  if(start == end)
+    return;
+  if(nroot_tasks == root_tasks_cap){
+    root_tasks_cap = root_tasks_cap * 2 + 16;
+    root_tasks = realloc(root_tasks, sizeof(RootTask) * root_tasks_cap);
+  }
+  root_tasks[nroot_tasks].start = start;
+  root_tasks[nroot_tasks].end = end;
+  nroot_tasks++;
+}
+
+//Splits the globals, the frames and the operand stack into tasks.
+void make_root_tasks () {
+  nroot_tasks = 0;
+  next_root_task = 0;
+  add_root_task((void**)&nullobj, (void**)&nullobj + 1);
+  add_root_task(genv, genv + globals->size);
+  void** frame_top = fsp;
+  void** frame_bot = fp;
+  while(frame_top > fstack){
+    add_root_task(frame_bot + 2, frame_top);
+    frame_top = frame_bot;
+    frame_bot = frame_bot[1];
+  }
+  for(void** p = vstack; p < vsp; p += VSTACK_TASK)
+    add_root_task(p, p + VSTACK_TASK < vsp? p + VSTACK_TASK : vsp);
+}
+
+void init_gc_threads () {
+  char* str = opt_gc_threads? opt_gc_threads : getenv("FEENY_GC_THREADS");
+  gc_threads = str? atoi(str) : 1;
+  if(gc_threads < 1 || gc_threads > MAX_GC_THREADS){
+    printf("Invalid number of GC threads: %s\n", str);
+    exit(-1);
+  }
+  if(gc_threads == 1)
+    return;
+  gc_thread = calloc(gc_threads, sizeof(GCThread));
+  pthread_barrier_init(&gc_start, 0, gc_threads);
+  pthread_barrier_init(&gc_done, 0, gc_threads);
+  for(int i=0; i<gc_threads; i++){
+    gc_thread[i].deque.array = make_deque_array(1024);
+    gc_thread[i].seed = i + 1;
+    if(i > 0 && pthread_create(&gc_thread[i].thread, 0, gc_worker, &gc_thread[i])){
+      printf("Could not start GC thread.\n");
+      exit(-1);
+    }
+  }
+}
+
+//Grows free_mem before a flip so that it also has room for the LABs
+//that are only partly used.
+void reserve_par_space () {
+  long used = opt_gen? (tenure_ptr - heap_mem) + (heap_ptr - nursery) : heap_ptr - heap_mem;
+  long needed = used + used / 64 + gc_threads * LAB_SIZE;
+  if(free_sz < needed){
+    while(heap_sz < needed)
+      heap_sz *= 2;
+    resize_free_space();
+  }
+}
+
+//Copies the live objects into heap_mem after the flip.
+void par_collect () {
+  make_root_tasks();
+  to_offset = 0;
+  idle_threads = 0;
+  pthread_barrier_wait(&gc_start);
+  par_work(&gc_thread[0]);
+  pthread_barrier_wait(&gc_done);
+  heap_ptr = heap_mem + to_offset;
+  for(int i=0; i<gc_threads; i++){
+    Deque* d = &gc_thread[i].deque;
+    while(d->retired){
+      DequeArray* a = d->retired;
+      d->retired = a->next;
+      free(a);
+    }
+  }
+}
+
+//============================================================
+//================ INCREMENTAL COLLECTOR =====================
+//============================================================
+
+//With -incremental <us>, collection is spread over slices of at most
+//pause_target microseconds. It replicates the live objects into
+//free_mem while the mutator keeps using the originals in heap_mem:
+//
+//- A cycle starts once heap_mem is INC_TRIGGER percent full. New objects
+//  are still allocated in heap_mem during the cycle.
+//- heap_top is kept slice_bytes past heap_ptr, so a slice runs after
+//  every slice_bytes of allocation. A slice first refreshes the
+//  replicas of objects that were written since the last slice, and
+//  then copies and scans replicas until the time is up.
+//- Since the originals are still in use, forwarding addresses are kept
+//  in forward_table instead of in the objects. It has an entry for
+//  each 16 bytes of heap_mem (8 with COMPACT_HEAP), which is the
+//  smallest object size. An
+//  entry holds the offset of the replica in 8 byte words plus one, or
+//  zero if there is none, and LOGGED_BIT if the object is in
+//  mutation_log.
+//- The write barrier on slots and arrays logs objects that already
+//  have a replica. The barrier on globals replicates the stored value.
+//- When no work is left, the flip rescans the roots, finishes the
+//  replicas they lead to, and points the roots at the replicas.
+//
+//If heap_mem fills up before the cycle is done, the cycle is finished
+//in one pause and slices are run twice as often afterwards.
+#define LOGGED_BIT 0x80000000u
+#define SCAN_CHECK 32
+
+long pause_target;
+long slice_bytes;
+unsigned int* forward_table;
+long forward_table_sz;
+char* to_ptr;
+char* scan_ptr;
+Vector* mutation_log;
+
+void init_incremental () {
+  if(opt_gen || gc_threads > 1){
+    printf("Incremental collection cannot be combined with -gen or -gcthreads.\n");
+    exit(-1);
+  }
+  pause_target = atol(opt_incremental);
+  if(pause_target <= 0){
+    printf("Invalid pause target: %s\n", opt_incremental);
+    exit(-1);
+  }
+  slice_bytes = 64 * 1024;
+  mutation_log = make_vector();
+  heap_top = heap_mem + heap_mem_sz * INC_TRIGGER / 100;
+}
+
+unsigned int* forward_entry (void* o) {
+  return &forward_table[((char*)o - heap_mem) >> MIN_OBJ_SHIFT];
+}
+
+void* replica (unsigned int entry) {
+  return free_mem + (long)((entry & ~LOGGED_BIT) - 1) * 8;
+}
+
+void* replicate_ptr (void* ptr) {
+  if(is_int(ptr))
+    return ptr;
+  if(is_large(ptr)){
+    mark_large(ptr);
+    return ptr;
+  }
+  unsigned int* entry = forward_entry(ptr);
+  if(*entry)
+    return replica(*entry);
+  void* dst = to_ptr;
+  int sz = sizeof_obj((VMObj*)ptr);
+  memcpy(dst, ptr, sz);
+  to_ptr += sz;
+  *entry = ((to_ptr - sz - free_mem) >> 3) + 1;
+  return dst;
+}
+
+void log_write (void* o) {
+  if(is_large(o))
+    return;
+  unsigned int* entry = forward_entry(o);
+  if(*entry && !(*entry & LOGGED_BIT)){
+    *entry |= LOGGED_BIT;
+    vector_add(mutation_log, o);
+  }
+}
+
+//Copies the current fields of the logged objects into their replicas.
+//Replicas that were already scanned are scanned again.
+void process_mutation_log () {
+  for(int i=0; i<mutation_log->size; i++){
+    void* o = vector_get(mutation_log, i);
+    unsigned int* entry = forward_entry(o);
+    *entry &= ~LOGGED_BIT;
+    char* r = replica(*entry);
+    memcpy(r, o, sizeof_obj(o));
+    if(r < scan_ptr)
+      scan_next(r);
+  }
+  vector_clear(mutation_log);
+}
+
+//Replicates the items of a large array, which is not changed since
+//the mutator still uses it.
+void shade_large (VMArray* a) {
+  for(int i=0; i<a->length; i++)
+    replicate_ptr(decode_ref(a->items[i]));
+}
+
+//Replicates the objects the roots point to, without changing the roots.
+void shade_roots () {
+  for(int i=0; i<globals->size; i++)
+    replicate_ptr(genv[i]);
+  void** frame_top = fsp;
+  void** frame_bot = fp;
+  while(frame_top > fstack){
+    for(void** p = frame_bot + 2; p < frame_top; p++)
+      replicate_ptr(*p);
+    frame_top = frame_bot;
+    frame_bot = frame_bot[1];
+  }
+  for(void** p = vstack; p < vsp; p++)
+    replicate_ptr(*p);
+  replicate_ptr(nullobj);
+}
+
+void start_cycle () {
+  if(heap_sz < heap_mem_sz)
+    heap_sz = heap_mem_sz;
+  resize_free_space();
+  forward_table_sz = sizeof(unsigned int) * ((heap_mem_sz >> MIN_OBJ_SHIFT) + 1);
+  forward_table = (unsigned int*)alloc_space(forward_table_sz);
+  to_ptr = scan_ptr = free_mem;
+  replicating = 1;
+  shade_roots();
+}
+
+void finish_cycle () {
+  gc_event.kind = "flip";
+  gc_event.before = heap_ptr - heap_mem;
+  process_mutation_log();
+  //Large objects marked by the slices still point at originals
+  vector_clear(gray_large);
+  for(LargeObj* h = large_objs; h; h = h->next)
+    if(h->marked)
+      vector_add(gray_large, h + 1);
+  scan_globals();
+  scan_fstack();
+  scan_vstack();
+  nullobj = link_ptr(nullobj);
+  while(1){
+    while(scan_ptr < to_ptr)
+      scan_ptr = scan_next(scan_ptr);
+    if(gray_large->size == 0)
+      break;
+    scan_array(vector_pop(gray_large));
+  }
+  sweep_large();
+  replicating = 0;
+  gc_event.live = to_ptr - free_mem;
+  munmap(forward_table, forward_table_sz);
+
+  //Flip flop heap
+  char* swap = heap_mem;
+  heap_mem = free_mem;
+  free_mem = swap;
+  long swap_sz = heap_mem_sz;
+  heap_mem_sz = free_sz;
+  free_sz = swap_sz;
+  heap_ptr = to_ptr;
+  gc_count++;
+  adapt_heap();
+  release_memory(free_mem, free_sz);
+}
+
+//Runs one slice of the cycle. Returns once pause_target has passed or
+//the cycle is finished.
+void gc_slice (double start) {
+  double deadline = start + pause_target / 1e3;
+  process_mutation_log();
+  while(1){
+    for(int i=0; i<SCAN_CHECK && scan_ptr < to_ptr; i++)
+      scan_ptr = scan_next(scan_ptr);
+    if(scan_ptr == to_ptr && gray_large->size > 0)
+      shade_large(vector_pop(gray_large));
+    if(scan_ptr == to_ptr && gray_large->size == 0){
+      //Everything replicated so far is scanned, so look for objects
+      //the roots have gained since the last slice.
+      shade_roots();
+      if(scan_ptr == to_ptr && gray_large->size == 0){
+        finish_cycle();
+        return;
+      }
+    }
+    if(now_ms() >= deadline)
+      return;
+  }
+}
+
+//Called from halloc when heap_ptr reaches heap_top.
+void incremental_gc (int sz) {
+  double start = begin_pause();
+  long replicated = replicating? to_ptr - free_mem : 0;
+  long cycles = gc_count;
+  gc_event.kind = "slice";
+  if(replicating){
+    if(heap_ptr + sz > heap_mem + heap_mem_sz){
+      finish_cycle();
+      if(slice_bytes > 4 * 1024)
+        slice_bytes /= 2;
+    }else{
+      gc_slice(start);
+    }
+  }else if(heap_ptr + sz > heap_mem + heap_mem_sz * INC_TRIGGER / 100 ||
+           large_bytes_since_gc > heap_mem_sz){
+    start_cycle();
+    gc_slice(start);
+  }
+  if(replicating && heap_ptr + sz > heap_mem + heap_mem_sz)
+    finish_cycle();
+  if(gc_count > cycles)
+    gc_event.copied = gc_event.live - replicated;
+  else if(replicating)
+    gc_event.copied = to_ptr - free_mem - replicated;
+  record_pause(start);
+  if(heap_ptr + sz > heap_mem + heap_mem_sz)
+    grow_heap(heap_ptr - heap_mem + sz);
+
+  //Set the point at which to run the next slice
+  char* end = heap_mem + heap_mem_sz;
+  heap_top = replicating? heap_ptr + slice_bytes : heap_mem + heap_mem_sz * INC_TRIGGER / 100;
+  if(heap_top < heap_ptr + sz)
+    heap_top = heap_ptr + slice_bytes;
+  if(heap_top > end)
+    heap_top = end;
+}
+
+//============================================================
+//================ MARK-REGION COLLECTOR =====================
+//============================================================
+
+//With -immix, the heap is divided into blocks and lines instead of
+//semispaces, so no memory is held back for copying into:
+//
+//- The heap is made of BLOCK_SIZE blocks of LINE_SIZE lines, carved
+//  out of one region of heap_max bytes that is reserved up front. The
+//  number of blocks in use is limited by block_budget, which is sized
+//  like the semispaces are, between heap_init and heap_max bytes.
+//- heap_ptr and heap_top bump through a hole, which is a run of lines
+//  that were free after the last collection. When it is used up the
+//  allocator moves on to the next hole of the block, then to the next
+//  recyclable block, and then to a free block. Objects that are larger
+//  than a line and do not fit in the current hole are bump allocated
+//  in a separate overflow block, so that they do not skip small holes.
+//- A collection marks the live objects in place, in mark_bits with a
+//  bit per 8 bytes, and marks the lines that they cover. Blocks without
+//  marked lines become free, and the others are recycled.
+//- Before marking, the recyclable blocks with the most free lines are
+//  picked for evacuation, as long as their live lines fit in
+//  EVAC_RESERVE percent of the budget. The objects found in them are
+//  copied into free blocks and leave a BrokenHeart behind, so that
+//  their blocks become free. Once the reserve runs out the remaining
+//  objects are marked in place instead.
+//
+//Free blocks beyond what the budget can use are returned to the OS.
+#define BLOCK_SIZE (32 * 1024)
+#define LINE_SIZE 128
+#define LINES_PER_BLOCK (BLOCK_SIZE / LINE_SIZE)
+#define EVAC_RESERVE 5
+#define EVAC_MIN_FREE (LINES_PER_BLOCK / 4)
+
+//Block states. A released block is free and its memory was returned
+//to the OS.
+#define FREE_BLOCK 0
+#define RELEASED_BLOCK 1
+#define RECYCLABLE_BLOCK 2
+#define FULL_BLOCK 3
+
+#define block_addr(b) (immix_mem + (long)(b) * BLOCK_SIZE)
+#define block_index(o) (((char*)(o) - immix_mem) / BLOCK_SIZE)
+
+int opt_immix;
+char* immix_mem;
+long max_blocks;
+long nblocks;
+long used_blocks;
+long block_budget;
+unsigned char* block_state;
+short* block_free_lines;
+unsigned char* evacuating;
+unsigned char* line_marks;
+unsigned char* mark_bits;
+long* free_blocks;
+long nfree_blocks;
+long* recyclable_blocks;
+long nrecyclable;
+long next_recyclable;
+long hole_block;
+int hole_line;
+char* overflow_ptr;
+char* overflow_top;
+char* evac_ptr;
+char* evac_top;
+long evac_left;
+Vector* gray_objs;
+
+void init_immix () {
+  if(opt_gen || opt_incremental || gc_threads > 1){
+    printf("-immix cannot be combined with -gen, -incremental or -gcthreads.\n");
+    exit(-1);
+  }
+  max_blocks = (heap_max + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  immix_mem = map_memory(max_blocks * BLOCK_SIZE, HEAP_MAP_FLAGS | MAP_NORESERVE);
+  block_budget = heap_init / BLOCK_SIZE;
+  if(block_budget < 2)
+    block_budget = 2;
+  if(block_budget > max_blocks)
+    block_budget = max_blocks;
+  heap_mem_sz = block_budget * BLOCK_SIZE;
+  if(prefault)
+    touch_pages(immix_mem, heap_mem_sz);
+  block_state = calloc(max_blocks, 1);
+  block_free_lines = calloc(max_blocks, sizeof(short));
+  evacuating = calloc(max_blocks, 1);
+  line_marks = calloc(max_blocks * LINES_PER_BLOCK, 1);
+  mark_bits = calloc(max_blocks * BLOCK_SIZE / 64, 1);
+  free_blocks = malloc(sizeof(long) * max_blocks);
+  recyclable_blocks = malloc(sizeof(long) * max_blocks);
+  gray_objs = make_vector();
+  hole_block = -1;
+  heap_ptr = heap_top = immix_mem;
+  overflow_ptr = overflow_top = immix_mem;
+
+  //Arrays that would take up much of a block are large objects
+  long max_length = (BLOCK_SIZE / 4 - sizeof(VMArray)) / sizeof(Ref);
+  if(large_array_length > max_length)
+    large_array_length = max_length;
+}
+
+//Takes a free block, or returns -1 if there is none.
+long take_block () {
+  long b;
+  if(nfree_blocks > 0)
+    b = free_blocks[--nfree_blocks];
+  else if(nblocks < max_blocks)
+    b = nblocks++;
+  else
+    return -1;
+  block_state[b] = FULL_BLOCK;
+  used_blocks++;
+  return b;
+}
+
+//Points heap_ptr and heap_top at the next hole that can hold sz bytes.
+//Returns 0 if none is left within the budget.
+int next_hole (int sz) {
+  while(1){
+    if(hole_block >= 0){
+      unsigned char* marks = line_marks + hole_block * LINES_PER_BLOCK;
+      while(hole_line < LINES_PER_BLOCK){
+        if(marks[hole_line]){
+          hole_line++;
+          continue;
+        }
+        int start = hole_line;
+        while(hole_line < LINES_PER_BLOCK && !marks[hole_line])
+          hole_line++;
+        if((hole_line - start) * LINE_SIZE >= sz){
+          heap_ptr = block_addr(hole_block) + start * LINE_SIZE;
+          heap_top = block_addr(hole_block) + hole_line * LINE_SIZE;
+          return 1;
+        }
+      }
+      hole_block = -1;
+    }
+    //The lines of a free block are all unmarked
+    if(next_recyclable < nrecyclable)
+      hole_block = recyclable_blocks[next_recyclable++];
+    else if(used_blocks < block_budget)
+      hole_block = take_block();
+    if(hole_block < 0)
+      return 0;
+    hole_line = 0;
+  }
+}
+
+void grow_budget () {
+  block_budget = block_budget * 2 < max_blocks? block_budget * 2 : max_blocks;
+  heap_mem_sz = block_budget * BLOCK_SIZE;
+}
+
+void immix_gc ();
+
+//Called from halloc when the object does not fit in the current hole.
+void* immix_alloc (int sz) {
+  for(int tries = 0; ; tries++){
+    if(sz > LINE_SIZE){
+      if(overflow_ptr + sz <= overflow_top)
+        break;
+      long b = used_blocks < block_budget? take_block() : -1;
+      if(b >= 0){
+        overflow_ptr = block_addr(b);
+        overflow_top = overflow_ptr + BLOCK_SIZE;
+        break;
+      }
+    }else if(next_hole(sz)){
+      break;
+    }
+    if(tries == 0)
+      immix_gc();
+    else if(tries == 1 && block_budget < max_blocks)
+      grow_budget();
+    else{
+      printf("Out of Memory.\n");
+      exit(-1);
+    }
+  }
+  char* obj;
+  if(sz > LINE_SIZE){
+    obj = overflow_ptr;
+    overflow_ptr += sz;
+  }else{
+    obj = heap_ptr;
+    heap_ptr += sz;
+  }
+  return obj;
+}
+
+//Copies an object out of a block being evacuated. Returns 0 once the
+//evacuation reserve is used up.
+char* evac_alloc (int sz) {
+  if(evac_ptr + sz > evac_top){
+    long b = evac_left > 0? take_block() : -1;
+    if(b < 0)
+      return 0;
+    evac_left--;
+    evac_ptr = block_addr(b);
+    evac_top = evac_ptr + BLOCK_SIZE;
+  }
+  char* dst = evac_ptr;
+  evac_ptr += sz;
+  return dst;
+}
+
+//Called by link_ptr during a collection. Marks ptr and the lines that
+//it covers, or evacuates it, and queues it to be scanned the first
+//time.
+void* mark_ptr (void* ptr) {
+  long tag = ((Header*)ptr)[0];
+  if(tag == -1)
+    return decode_ref(((BrokenHeart*)ptr)->forward);
+  if(is_large(ptr)){
+    mark_large(ptr);
+    return ptr;
+  }
+  long bit = ((char*)ptr - immix_mem) >> 3;
+  if(mark_bits[bit >> 3] & (1 << (bit & 7)))
+    return ptr;
+  int sz = sizeof_obj((VMObj*)ptr);
+  if(evacuating[block_index(ptr)]){
+    char* dst = evac_alloc(sz);
+    if(dst){
+      memcpy(dst, ptr, sz);
+      gc_event.copied += sz;
+      ptr = make_forward(ptr, dst);
+      bit = (dst - immix_mem) >> 3;
+    }
+  }
+  mark_bits[bit >> 3] |= 1 << (bit & 7);
+  long first = ((char*)ptr - immix_mem) / LINE_SIZE;
+  long last = ((char*)ptr + sz - 1 - immix_mem) / LINE_SIZE;
+  memset(line_marks + first, 1, last - first + 1);
+  if(tag != NULL_CLASS_TAG)
+    vector_add(gray_objs, ptr);
+  return ptr;
+}
+
+//Picks the recyclable blocks with at least threshold free lines for
+//evacuation, with threshold as low as the reserve allows. Their live
+//lines are counted from the last collection.
+void select_evacuation () {
+  evac_left = block_budget * EVAC_RESERVE / 100;
+  if(evac_left < 1)
+    evac_left = 1;
+  long live[LINES_PER_BLOCK + 1] = {0};
+  for(long i=0; i<nrecyclable; i++){
+    long b = recyclable_blocks[i];
+    live[block_free_lines[b]] += LINES_PER_BLOCK - block_free_lines[b];
+  }
+  long reserve = evac_left * LINES_PER_BLOCK;
+  long total = 0;
+  int threshold = LINES_PER_BLOCK;
+  while(threshold > EVAC_MIN_FREE && total + live[threshold - 1] <= reserve){
+    threshold--;
+    total += live[threshold];
+  }
+  for(long i=0; i<nrecyclable; i++){
+    long b = recyclable_blocks[i];
+    evacuating[b] = block_free_lines[b] >= threshold;
+  }
+  evac_ptr = evac_top = immix_mem;
+}
+
+//Frees the blocks without marked lines and lists the others that have
+//free lines as recyclable. Returns the number of marked lines.
+long sweep_blocks () {
+  long live = 0;
+  nrecyclable = 0;
+  next_recyclable = 0;
+  for(long b=0; b<nblocks; b++){
+    evacuating[b] = 0;
+    if(block_state[b] == FREE_BLOCK || block_state[b] == RELEASED_BLOCK)
+      continue;
+    unsigned char* marks = line_marks + b * LINES_PER_BLOCK;
+    int free = 0;
+    for(int i=0; i<LINES_PER_BLOCK; i++)
+      free += !marks[i];
+    block_free_lines[b] = free;
+    live += LINES_PER_BLOCK - free;
+    if(free == LINES_PER_BLOCK){
+      block_state[b] = FREE_BLOCK;
+      free_blocks[nfree_blocks++] = b;
+      used_blocks--;
+    }else if(free > 0){
+      block_state[b] = RECYCLABLE_BLOCK;
+      recyclable_blocks[nrecyclable++] = b;
+    }else{
+      block_state[b] = FULL_BLOCK;
+    }
+  }
+  return live;
+}
+
+//Sizes the budget like adapt_heap sizes the semispaces, and returns
+//the free blocks that it leaves no room for to the OS. Those are at
+//the bottom of free_blocks, so they are taken last.
+void adapt_budget (long live) {
+  long survival = (live * LINE_SIZE + large_bytes) * 100 / heap_mem_sz;
+  if(survival > heap_grow){
+    low_gcs = 0;
+    if(block_budget < max_blocks)
+      grow_budget();
+  }else if(survival < heap_shrink){
+    low_gcs++;
+    if(low_gcs >= SHRINK_GCS && (block_budget / 2) * BLOCK_SIZE >= heap_init &&
+       block_budget / 2 >= used_blocks * 2){
+      low_gcs = 0;
+      block_budget /= 2;
+      heap_mem_sz = block_budget * BLOCK_SIZE;
+    }
+  }else{
+    low_gcs = 0;
+  }
+  long keep = block_budget - used_blocks;
+  for(long i=0; i<nfree_blocks - keep; i++){
+    long b = free_blocks[i];
+    if(block_state[b] == FREE_BLOCK){
+      madvise(block_addr(b), BLOCK_SIZE, MADV_DONTNEED);
+      block_state[b] = RELEASED_BLOCK;
+    }
+  }
+}
+
+void immix_gc () {
+  double start = begin_pause();
+  gc_count++;
+  gc_event.kind = "immix";
+  gc_event.before = used_blocks * BLOCK_SIZE;
+  select_evacuation();
+  for(long b=0; b<nblocks; b++){
+    if(block_state[b] == FREE_BLOCK || block_state[b] == RELEASED_BLOCK)
+      continue;
+    memset(line_marks + b * LINES_PER_BLOCK, 0, LINES_PER_BLOCK);
+    memset(mark_bits + b * (BLOCK_SIZE / 64), 0, BLOCK_SIZE / 64);
+  }
+
+  //Scan roots
+  scan_globals();
+  scan_fstack();
+  scan_vstack();
+  nullobj = link_ptr(nullobj);
+
+  //Scan marked objects and large objects
+  while(1){
+    if(gray_objs->size > 0)
+      scan_next(vector_pop(gray_objs));
+    else if(gray_large->size > 0)
+      scan_array(vector_pop(gray_large));
+    else
+      break;
+  }
+
+  sweep_large();
+  long live = sweep_blocks();
+  gc_event.live = live * LINE_SIZE;
+  adapt_budget(live);
+  hole_block = -1;
+  heap_ptr = heap_top = immix_mem;
+  overflow_ptr = overflow_top = immix_mem;
+  record_pause(start);
+}
+
+//============================================================
+//============================================================
+               
+
+unsigned char next_char () {
+  unsigned char c = ip[0];
+  ip++;
+  return c;
+}
+
+int next_short () {
+  ip = (char*)(((long)ip + 1)&(-2));
+  int s = ((unsigned short*)ip)[0];  
+  ip += 2;
+  return s;
+}
+
+int next_int () {
+  ip = (char*)(((long)ip + 3)&(-4));
+  int s = ((int*)ip)[0];  
+  ip += 4;
+  return s;
+}
+
+void* next_ptr () {
+  ip = (char*)(((long)ip + 7)&(-8));
+  void* s = ((void**)ip)[0];  
+  ip += 8;
+  return s;
+}
+
+InlineCache* next_cache () {
+  ip = (char*)(((long)ip + 7)&(-8));
+  InlineCache* c = (InlineCache*)ip;
+  ip += sizeof(InlineCache);
+  return c;
+}
+
+#ifdef THREADED_DISPATCH
+void* next_op () {
+  return next_ptr();
+}
+#else
+unsigned char next_op () {
+  return next_char();
+}
+#endif
+
+void initvm (char* entry) {
+  //Initialize State
+  ip = entry;
+  n = 0;
+  init_stacks();
+  genv = malloc(sizeof(void*) * globals->size);
+  vm_start_ms = now_ms();
+  init_gc_log();
+  init_heap();
+  init_large_objs();
+  init_gc_threads();
+  init_copy_order();
+  if(opt_immix)
+    init_immix();
+  if(opt_incremental)
+    init_incremental();
+  if(opt_gen)
+    init_generations();
+  init_method_cache();
+  if(opt_profile)
+    init_profile();
+  nullobj = alloc_null();
+  
+  //Initialize globals
+  for(int i=0; i<globals->size; i++){
+    genv[i] = nullobj;
+    global_barrier(i, nullobj);
+  }
+
+  //Default Frame
+  fp = fsp;
+  fp[0] = 0;
+  fp[1] = 0;
+  fp[2] = box_int(0);
+  fsp = fp + 2;
+}
+
+void ensure_arity (int actual, int desired) {
+  if(actual != desired){
+    printf("Incorrect arity: Expected %d but received %d.\n", desired, actual);
+    exit(-1);
+  }
+}
+
+void ensure_parent (VMObj* o) {
+  if(is_int(o)){
+    printf("Int is not a legal parent.\n");
+    exit(-1);
+  }
+  else if(o->tag == ARRAY_CLASS_TAG){
+    printf("Array is not a legal parent.\n");
+    exit(-1);
+  }  
+}
+
+void ensure_int (void* o) {
+  if(!is_int(o)){
+    printf("Not an integer!\n");
+    exit(-1);
+  }
+}
+
+void ensure_index (void* i, VMArray* a) {
+  ensure_int(i);
+  if(unbox_int(i) < 0 || unbox_int(i) >= a->length){
+    printf("Index %d is out of bounds.\n", unbox_int(i));
+    exit(-1);
+  }
+}
+
+void print_vstack () {
+  printf("[");
+  for(void** p = vstack; p < vsp; p++){
+    void* obj = *p;
+    if(p > vstack) printf(" ");
+    printf("%d", (int)obj_tag(obj));
+  }
+  printf("]\n");
+}
+
+void print_obj (VMObj* obj) {
+  if(is_int(obj)){
+    printf("%d", unbox_int(obj));
+  }else if(obj->tag == NULL_CLASS_TAG){
+    printf("null");
+  }else if(obj->tag == ARRAY_CLASS_TAG){
+    VMArray* o = (VMArray*)obj;
+    printf("[");
+    for(int i=0; i<o->length; i++){
+      if(i > 0) printf(" ");
+      print_obj(decode_ref(o->items[i]));
+    }
+    printf("]");
+  }else{
+    printf("[Object %ld]", (long)obj->tag);
+  }
+}
+
+void print_format (char* format, int n) {
+  void** args = vsp - n;
+  while(1){
+    char c = format[0];
+    if(c == 0) return;
+    if(c == '~') {
+      print_obj(args[0]);
+      args++;
+    }else{
+      printf("%c", c);
+    }
+    format++;    
+  }
+}
+
+//============================================================
+//===================== QUICKENING ===========================
+//============================================================
+
+//The first time a CALL_SLOT_INS calls a builtin Int or Array slot, the
+//instruction is rewritten in place into a specialized opcode. Sites
+//with the wrong arity are left alone so that they report the error.
+
+int is_array (void* o) {
+  return !is_int(o) && ((VMObj*)o)->tag == ARRAY_CLASS_TAG;
+}
+
+//Returns the address of the opcode of the instruction being executed,
+//given that ip points just past it.
+char* current_op () {
+#ifdef THREADED_DISPATCH
+  return ip - sizeof(void*);
+#else
+  return ip - 1;
+#endif
+}
+
+void set_op (char* p, OpTag op) {
+#ifdef THREADED_DISPATCH
+  if(profiling)
+    op_map[p - code] = op;
+  else
+    ((void**)p)[0] = op_handlers[op];
+#else
+  p[0] = op;
+#endif
+}
+
+//Returns the opcode of the instruction at p.
+int op_at (char* p) {
+#ifdef THREADED_DISPATCH
+  p = (char*)(((long)p + 7)&(-8));
+  if(profiling)
+    return op_map[p - code];
+  void* h = ((void**)p)[0];
+  for(int i=0; i<NUM_OPS; i++)
+    if(op_handlers[i] == h)
+      return i;
+  return -1;
+#else
+  return (unsigned char)p[0];
+#endif
+}
+
+void skip_call_slot () {
+  next_char();
+  next_int();
+  next_cache();
+}
+
+//ip points just past the CALL_SLOT_INS. Comparisons that are directly
+//followed by a branch are fused with it.
+void quicken_int_slot (char* op, int name, int arity) {
+  if(arity != 2 || name < EQ_SYM || name > MOD_SYM)
+    return;
+  if(name <= GE_SYM && super_enabled[CMP_BRANCH_SUPER] && op_at(ip) == BRANCH_INS)
+    set_op(op, INT_EQ_BRANCH_INS + name - EQ_SYM);
+  else
+    set_op(op, INT_EQ_INS + name - EQ_SYM);
+}
+
+void quicken_array_slot (char* op, int name, int arity) {
+  if(name == GET_SYM && arity == 2)
+    set_op(op, ARRAY_GET_INS);
+  else if(name == SET_SYM && arity == 3)
+    set_op(op, ARRAY_SET_INS);
+  else if(name == LENGTH_SYM && arity == 1)
+    set_op(op, ARRAY_LENGTH_INS);
+}
+
+//============================================================
+//============================================================
+
+//With TOS_CACHE, the top of the operand stack is kept in the local
+//tos of run_loop instead of in vstack. Handlers that call code which
+//uses vstack directly, or that may allocate, first SPILL it back onto
+//vstack so that the helpers and scan_vstack see every value. Calls
+//leave the stack spilled, and FRAME_INS fills it again.
+#ifdef TOS_CACHE
+#define VTOP tos
+#define VSECOND vsp[-1]
+#define VTHIRD vsp[-2]
+#define PUSH(x) (*vsp++ = tos, tos = (x))
+#define POP() (popped = tos, tos = *--vsp, popped)
+#define DROPN(n) (vsp -= (n), tos = *vsp)
+#define SPILL() (*vsp++ = tos)
+#define FILL() (tos = *--vsp)
+#else
+#define VTOP vsp[-1]
+#define VSECOND vsp[-2]
+#define VTHIRD vsp[-3]
+#define PUSH(x) vpush(x)
+#define POP() vpop()
+#define DROPN(n) (vsp -= (n))
+#define SPILL()
+#define FILL()
+#endif
+
+#ifdef THREADED_DISPATCH
+#define CASE(op) op##_HANDLER:
+#define DISPATCH() goto *next_op()
+#define NEXT() DISPATCH()
+#else
+#define CASE(op) case op: op##_HANDLER:
+#define NEXT() break
+#endif
+
+//Runs the interpreter loop. If get_handlers is set, the loop does
+//not run, and the table of opcode handler addresses is returned
+//instead so that the linker can thread the code.
+void** run_loop (int get_handlers) {
+#ifdef THREADED_DISPATCH
+  static void* handlers[] = {
+    &&INT_INS_HANDLER,
+    &&NULL_INS_HANDLER,
+    &&PRINTF_INS_HANDLER,
+    &&ARRAY_INS_HANDLER,
+    &&OBJECT_INS_HANDLER,
+    &&SLOT_INS_HANDLER,
+    &&SET_SLOT_INS_HANDLER,
+    &&CALL_SLOT_INS_HANDLER,
+    &&CALL_INS_HANDLER,
+    &&SET_LOCAL_INS_HANDLER,
+    &&GET_LOCAL_INS_HANDLER,
+    &&SET_GLOBAL_INS_HANDLER,
+    &&GET_GLOBAL_INS_HANDLER,
+    &&BRANCH_INS_HANDLER,
+    &&GOTO_INS_HANDLER,
+    &&RETURN_INS_HANDLER,
+    &&DROP_INS_HANDLER,
+    &&FRAME_INS_HANDLER,
+    &&INT_EQ_INS_HANDLER,
+    &&INT_LT_INS_HANDLER,
+    &&INT_LE_INS_HANDLER,
+    &&INT_GT_INS_HANDLER,
+    &&INT_GE_INS_HANDLER,
+    &&INT_ADD_INS_HANDLER,
+    &&INT_SUB_INS_HANDLER,
+    &&INT_MUL_INS_HANDLER,
+    &&INT_DIV_INS_HANDLER,
+    &&INT_MOD_INS_HANDLER,
+    &&ARRAY_GET_INS_HANDLER,
+    &&ARRAY_SET_INS_HANDLER,
+    &&ARRAY_LENGTH_INS_HANDLER,
+    &&GET_LOCAL2_INS_HANDLER,
+    &&GET_LOCAL_INT_INS_HANDLER,
+    &&SET_LOCAL_DROP_INS_HANDLER,
+    &&SET_GLOBAL_DROP_INS_HANDLER,
+    &&INT_EQ_BRANCH_INS_HANDLER,
+    &&INT_LT_BRANCH_INS_HANDLER,
+    &&INT_LE_BRANCH_INS_HANDLER,
+    &&INT_GT_BRANCH_INS_HANDLER,
+    &&INT_GE_BRANCH_INS_HANDLER,
+    &&PROFILE_HANDLER
+  };
+  if(get_handlers)
+    return handlers;
+#endif
+#ifdef TOS_CACHE
+  void* tos;
+  void* popped;
+  //The entry frame starts with an empty, spilled stack
+  vpush(box_int(0));
+#endif
+#ifdef THREADED_DISPATCH
+  DISPATCH();
+#else
+  if(get_handlers)
+    return 0;
+  while(ip){
+    //    printf("IP = 0x%lx\n", ip);
+    //    print_vstack();
+    
+    char tag = next_op();
+    if(profiling)
+      count_op(current_op(), tag);
+    switch(tag){
+#endif
+    CASE(INT_INS) {
+      int i = next_int();
+      //printf("Run Int(%d)\n", i);
+      PUSH(box_int(i));
+      NEXT();
     }
-    case NULL_INS : {
+    CASE(NULL_INS) {
       //printf("Run Null\n");
-      vector_add(vstack, nullobj);
-      break;
+      PUSH(nullobj);
+      NEXT();
     }
-    case PRINTF_INS : {
+    CASE(PRINTF_INS) {
       int n = next_char();
       char* format = next_ptr();
       //printf("Run Printf(");
       //print_string(format);
       //printf(", %d)\n", n);
+      SPILL();
       print_format(format, n);
-      for(int i=0; i<n; i++)
-        vector_pop(vstack);
-      vector_add(vstack, nullobj);
-      break;
+      vsp -= n;
+      vpush(nullobj);
+      FILL();
+      NEXT();
     }
-    case ARRAY_INS : {
+    CASE(ARRAY_INS) {
       //printf("Run Array\n");
-      VMInt* len = vector_get(vstack, vstack->size - 2);
+      SPILL();
+      void* len = vsp[-2];
       ensure_int(len);
-      VMArray* a = alloc_empty_array(len->value);
-      void* init = vector_pop(vstack);
-      vector_pop(vstack);
-      for(int i=0; i<len->value; i++)
-        a->items[i] = init;
-      vector_add(vstack, a);
-      break;
+      int length = unbox_int(len);
+      VMArray* a = alloc_empty_array(ip - OP_WIDTH, length);
+      void* init = vpop();
+      vpop();
+      for(int i=0; i<length; i++)
+        a->items[i] = encode_ref(init);
+      vpush(a);
+      FILL();
+      NEXT();
     }
-    case OBJECT_INS: {
+    CASE(OBJECT_INS) {
+      char* site = ip - OP_WIDTH;
       int arity = next_char();
       int class = next_short();      
       //printf("Run Object(%d,%d)\n", class, arity);
-      VMObj* o = alloc_object(class, arity);
+      SPILL();
+      VMObj* o = alloc_object(site, class, arity);
       for(int i = arity-1; i>=0; i--)
-        o->slots[i] = vector_pop(vstack);
-      void* parent = vector_pop(vstack);
+        o->slots[i] = encode_ref(vpop());
+      void* parent = vpop();
       ensure_parent(parent);
-      o->parent = parent;
-      vector_add(vstack, o);
-      break;
+      o->parent = encode_ref(parent);
+      vpush(o);
+      FILL();
+      NEXT();
     }
-    case SLOT_INS: {
-      char* name = next_ptr();
+    CASE(SLOT_INS) {
+      int name = next_int();
+      InlineCache* ic = next_cache();
       //printf("Run Slot(%s)\n", name);
-      VMObj* o = vector_pop(vstack);
-      if(o->tag == INT_CLASS_TAG || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
-        printf("No variable slot %s for object ", name);
+      VMObj* o = VTOP;
+      if(is_int(o) || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
+        printf("No variable slot %s for object ", symbol_name(name));
         print_obj(o);
         printf(".\n");
       }
-      LSlot slot = lookup_varslot(o, name);
-      vector_add(vstack, o->slots[slot.idx]);
-      break;
+      LSlot s;
+      LSlot* slot = ic_lookup(ic, o);
+      if(slot){
+        ic_stats[SLOT_INS].hits++;
+      }else{
+        ic_stats[SLOT_INS].misses++;
+        int depth = 0;
+        s = lookup_varslot(o, name, &depth);
+        ic_update(ic, o, s, depth);
+        slot = &s;
+      }
+      VTOP = decode_ref(o->slots[slot->idx]);
+      NEXT();
     }
-    case SET_SLOT_INS: {
-      char* name = next_ptr();
+    CASE(SET_SLOT_INS) {
+      int name = next_int();
+      InlineCache* ic = next_cache();
       //printf("Run SetSlot(%s)\n", name);
-      void* x = vector_pop(vstack);
-      VMObj* o = vector_pop(vstack);
-      if(o->tag == INT_CLASS_TAG || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
-        printf("No variable slot %s for object ", name);
+      void* x = POP();
+      VMObj* o = VTOP;
+      if(is_int(o) || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
+        printf("No variable slot %s for object ", symbol_name(name));
         print_obj(o);
         printf(".\n");
       }
-      LSlot slot = lookup_varslot(o, name);
-      o->slots[slot.idx] = x;
-      vector_add(vstack, x);
-      break;
+      LSlot s;
+      LSlot* slot = ic_lookup(ic, o);
+      if(slot){
+        ic_stats[SET_SLOT_INS].hits++;
+      }else{
+        ic_stats[SET_SLOT_INS].misses++;
+        int depth = 0;
+        s = lookup_varslot(o, name, &depth);
+        ic_update(ic, o, s, depth);
+        slot = &s;
+      }
+      write_barrier(o, x);
+      o->slots[slot->idx] = encode_ref(x);
+      VTOP = x;
+      NEXT();
     }
-    case CALL_SLOT_INS: {
+    CASE(CALL_SLOT_INS) {
+      char* op = current_op();
       n = next_char();
-      char* name = next_ptr();
+      int name = next_int();
+      InlineCache* ic = next_cache();
       //printf("Run CallSlot(%s, %d)\n", name, n);
-      int sp = vstack->size;
-      VMObj* obj = vector_get(vstack, sp - n);
-      if(obj->tag == INT_CLASS_TAG){
+      SPILL();
+      VMObj* obj = vsp[-n];
+      if(is_int(obj)){
+        quicken_int_slot(op, name, n);
         call_int_slot(name, n);
-        break;
+        FILL();
+        NEXT();
       }
       else if(obj->tag == ARRAY_CLASS_TAG){
+        quicken_array_slot(op, name, n);
         call_array_slot(name, n);
-        break;
+        FILL();
+        NEXT();
       }
       else if(obj->tag == NULL_CLASS_TAG){
-        printf("No slot named %s for Null.\n", name);
+        printf("No slot named %s for Null.\n", symbol_name(name));
         exit(-1);
       }
       else{
-        LSlot m = lookup_method(obj, name);
-        int newfp = fstack->size;
-        vector_add(fstack, ip);
-        vector_add(fstack, (void*)fp);
-        fp = newfp;
-        ip = m.code;
-        break;
+        LSlot s;
+        LSlot* m = ic_lookup(ic, obj);
+        if(m){
+          ic_stats[CALL_SLOT_INS].hits++;
+        }else{
+          ic_stats[CALL_SLOT_INS].misses++;
+          int depth = 0;
+          s = lookup_method(obj, name, &depth);
+          ic_update(ic, obj, s, depth);
+          m = &s;
+        }
+        fsp[0] = ip;
+        fsp[1] = fp;
+        fp = fsp;
+        fsp += 2;
+        ip = m->code;
+        NEXT();
       }
     }
-    case CALL_INS : {
+    CASE(CALL_INS) {
       n = next_char();
       void* code = next_ptr();
       //printf("Run Call(0x%lx, %d)\n", code, n);      
-      int newfp = fstack->size;
-      vector_add(fstack, ip);
-      vector_add(fstack, (void*)fp);
-      fp = newfp;
+      SPILL();
+      fsp[0] = ip;
+      fsp[1] = fp;
+      fp = fsp;
+      fsp += 2;
       ip = code;
-      break;
+      NEXT();
     }
-    case SET_LOCAL_INS : {
+    CASE(SET_LOCAL_INS) {
       int idx = next_short();
       //printf("Run SetLocal(%d)\n", idx);
-      void* v = vector_peek(vstack);
-      vector_set(fstack, fp + 2 + idx, v);
-      break;
+      fp[2 + idx] = VTOP;
+      NEXT();
     }
-    case GET_LOCAL_INS : {
+    CASE(GET_LOCAL_INS) {
       int idx = next_short();
       //printf("Run GetLocal(%d)\n", idx);
-      void* v = vector_get(fstack, fp + 2 + idx);
-      vector_add(vstack, v);      
-      break;
+      PUSH(fp[2 + idx]);
+      NEXT();
     }
-    case SET_GLOBAL_INS : {
+    CASE(SET_GLOBAL_INS) {
       int idx = next_short();
       //printf("Run SetGlobal(%d)\n", idx);
-      genv[idx] = vector_peek(vstack);
-      break;
+      global_barrier(idx, VTOP);
+      genv[idx] = VTOP;
+      NEXT();
     }
-    case GET_GLOBAL_INS : {
+    CASE(GET_GLOBAL_INS) {
       int idx = next_short();
       //printf("Run GetGlobal(%d)\n", idx);
-      vector_add(vstack, genv[idx]);
-      break;
+      PUSH(genv[idx]);
+      NEXT();
     }
-    case BRANCH_INS : {
+    CASE(BRANCH_INS) {
       void* code = next_ptr();
       //printf("Run Branch(0x%lx)\n", code);
-      VMObj* obj = vector_pop(vstack);
-      if(obj->tag != NULL_CLASS_TAG)
+      VMObj* obj = POP();
+      if(is_int(obj) || obj->tag != NULL_CLASS_TAG)
         ip = code;
-      break;
+      NEXT();
+    }
+    CASE(GOTO_INS) {
+      void* code = next_ptr();
+      //printf("Run Goto(0x%lx)\n", code);
+      ip = code;
+      NEXT();
+    }
+    CASE(RETURN_INS) {
+      //printf("Run Return\n");
+      ip = fp[0];
+      fsp = fp;
+      fp = fp[1];
+      if(!ip)
+        return 0;
+      NEXT();
+    }
+    CASE(DROP_INS) {
+      //printf("Run Drop\n");
+      DROPN(1);
+      NEXT();
+    }
+    CASE(FRAME_INS) {
+      int nargs = next_char();
+      int nlocals = next_short();
+      //printf("Run Frame(%d,%d)\n", nargs, nlocals);
+      ensure_arity(n, nargs);
+      vsp -= nargs;
+      for(int i=0; i<nargs; i++)
+        fp[2 + i] = vsp[i];
+      fsp = fp + 2 + nargs;
+      for(int i=0; i<nlocals; i++)
+        *fsp++ = nullobj;
+      FILL();
+      NEXT();
+    }
+    //Quickened call slots. The operands of the original CALL_SLOT_INS
+    //are skipped. If the receiver does not have the expected type, the
+    //instruction is executed as a generic CALL_SLOT_INS instead.
+#define QUICK_GUARD(test)                       \
+      char* start = ip;                         \
+      skip_call_slot();                         \
+      if(!(test)){                              \
+        ip = start;                             \
+        goto CALL_SLOT_INS_HANDLER;             \
+      }
+#define INT_OP(OP, result)                      \
+    CASE(OP) {                                  \
+      QUICK_GUARD(is_int(VTOP) && is_int(VSECOND));  \
+      long x = unbox_int(VSECOND);              \
+      long y = unbox_int(VTOP);                 \
+      DROPN(1);                                 \
+      VTOP = result;                            \
+      NEXT();                                   \
+    }
+#define BOOL(x) ((x)? box_int(0) : (void*)nullobj)
+    INT_OP(INT_EQ_INS, BOOL(x == y))
+    INT_OP(INT_LT_INS, BOOL(x < y))
+    INT_OP(INT_LE_INS, BOOL(x <= y))
+    INT_OP(INT_GT_INS, BOOL(x > y))
+    INT_OP(INT_GE_INS, BOOL(x >= y))
+    INT_OP(INT_ADD_INS, box_int((int)(x + y)))
+    INT_OP(INT_SUB_INS, box_int((int)(x - y)))
+    INT_OP(INT_MUL_INS, box_int((int)(x * y)))
+    INT_OP(INT_DIV_INS, box_int((int)(x / y)))
+    INT_OP(INT_MOD_INS, box_int((int)(x % y)))
+    CASE(ARRAY_GET_INS) {
+      QUICK_GUARD(is_array(VSECOND));
+      void* i = POP();
+      VMArray* a = VTOP;
+      ensure_index(i, a);
+      VTOP = decode_ref(a->items[unbox_int(i)]);
+      NEXT();
+    }
+    CASE(ARRAY_SET_INS) {
+      QUICK_GUARD(is_array(VTHIRD));
+      void* v = POP();
+      void* i = POP();
+      VMArray* a = VTOP;
+      ensure_index(i, a);
+      write_barrier(a, v);
+      a->items[unbox_int(i)] = encode_ref(v);
+      VTOP = nullobj;
+      NEXT();
+    }
+    CASE(ARRAY_LENGTH_INS) {
+      QUICK_GUARD(is_array(VTOP));
+      VMArray* a = VTOP;
+      VTOP = box_int(a->length);
+      NEXT();
+    }
+#define INT_BRANCH_OP(OP, test)                 \
+    CASE(OP) {                                  \
+      QUICK_GUARD(is_int(VTOP) && is_int(VSECOND));  \
+      long x = unbox_int(VSECOND);              \
+      long y = unbox_int(VTOP);                 \
+      DROPN(2);                                 \
+      next_op();                                \
+      void* code = next_ptr();                  \
+      if(test)                                  \
+        ip = code;                              \
+      NEXT();                                   \
+    }
+    INT_BRANCH_OP(INT_EQ_BRANCH_INS, x == y)
+    INT_BRANCH_OP(INT_LT_BRANCH_INS, x < y)
+    INT_BRANCH_OP(INT_LE_BRANCH_INS, x <= y)
+    INT_BRANCH_OP(INT_GT_BRANCH_INS, x > y)
+    INT_BRANCH_OP(INT_GE_BRANCH_INS, x >= y)
+    CASE(GET_LOCAL2_INS) {
+      int idx1 = next_short();
+      int idx2 = next_short();
+      PUSH(fp[2 + idx1]);
+      PUSH(fp[2 + idx2]);
+      NEXT();
+    }
+    CASE(GET_LOCAL_INT_INS) {
+      int idx = next_short();
+      int i = next_int();
+      PUSH(fp[2 + idx]);
+      PUSH(box_int(i));
+      NEXT();
+    }
+    CASE(SET_LOCAL_DROP_INS) {
+      int idx = next_short();
+      fp[2 + idx] = POP();
+      NEXT();
+    }
+    CASE(SET_GLOBAL_DROP_INS) {
+      int idx = next_short();
+      global_barrier(idx, VTOP);
+      genv[idx] = POP();
+      NEXT();
+    }
+#ifdef THREADED_DISPATCH
+    PROFILE_HANDLER: {
+      profile_op();
+      DISPATCH();
+    }
+#endif
+#ifndef THREADED_DISPATCH
+    default:
+      printf("Unknown tag: %d\n", tag);
+      exit(-1);
+    }
+  }
+#endif
+  return 0;
+}
+
+void runvm () {
+  if(opt_sample)
+    start_sampling();
+  if(opt_regs)
+    reg_loop(0);
+  else
+    run_loop(0);
+  if(opt_sample){
+    stop_sampling();
+    write_samples(opt_sample);
+  }
+  if(opt_perf)
+    print_perf();
+  if(opt_pair_profile)
+    write_pair_profile(opt_pair_profile);
+  if(opt_profile)
+    print_profile();
+  if(opt_ic_stats)
+    print_ic_stats();
+  if(opt_gc_stats)
+    print_gc_stats();
+  if(gc_log)
+    finish_gc_log();
+  if(opt_disasm)
+    print_code();
+}
+
+void push_bool (int bool) {
+  if(bool)
+    vpush(box_int(0));
+  else
+    vpush(nullobj);  
+}
+
+void push_int (int r) {
+  vpush(box_int(r));
+}
+
+void call_int_slot (int slotname, int n) {
+  ensure_arity(n, 2);
+  void* yobj = vpop();
+  void* xobj = vpop();
+  ensure_int(yobj);
+  long x = unbox_int(xobj);
+  long y = unbox_int(yobj);
+  switch(slotname){
+  case EQ_SYM: push_bool(x == y); break;
+  case LT_SYM: push_bool(x < y); break;
+  case LE_SYM: push_bool(x <= y); break;
+  case GT_SYM: push_bool(x > y); break;
+  case GE_SYM: push_bool(x >= y); break;
+  case ADD_SYM: push_int(x + y); break;
+  case SUB_SYM: push_int(x - y); break;
+  case MUL_SYM: push_int(x * y); break;
+  case DIV_SYM: push_int(x / y); break;
+  case MOD_SYM: push_int(x % y); break;
+  default:
+    printf("No slot named %s for Int.\n", symbol_name(slotname));
+    exit(-1);
+  }
+}
+
+void call_array_slot (int slotname, int n) {
+  if(slotname == GET_SYM){
+    ensure_arity(n, 2);
+    void* i = vpop();
+    VMArray* a = vpop();
+    ensure_index(i, a);
+    vpush(decode_ref(a->items[unbox_int(i)]));
+  }
+  else if(slotname == SET_SYM){
+    ensure_arity(n, 3);
+    void* v = vpop();
+    void* i = vpop();
+    VMArray* a = vpop();
+    ensure_index(i, a);
+    write_barrier(a, v);
+    a->items[unbox_int(i)] = encode_ref(v);
+    vpush(nullobj);
+  }
+  else if(slotname == LENGTH_SYM){
+    ensure_arity(n, 1);
+    VMArray* a = vpop();
+    push_int(a->length);
+  }
+  else{
+    printf("No slot named %s for Array.\n", symbol_name(slotname));
+    exit(-1);
+  }
+}
+
+//============================================================
+//================= REGISTER INTERPRETER =====================
+//============================================================
+
+//A register frame starts at fp and holds:
+//   fp[0]: return address
+//   fp[1]: caller's fp
+//   fp[2]: boxed register in the caller that receives the result
+//   fp[3...]: registers
+//The operand stack is only used to pass arguments to the builtin
+//slots and printf.
+#define REG(r) fp[3 + (r)]
+
+void reg_push_frame (int dst, int nargs, void* code) {
+  fsp[0] = ip;
+  fsp[1] = fp;
+  fsp[2] = box_int(dst);
+  fp = fsp;
+  n = nargs;
+  ip = code;
+}
+
+//Copies the n argument registers that follow ip into the next frame.
+void reg_gather_args (int n) {
+  for(int i=0; i<n; i++)
+    fsp[3 + i] = REG(next_short());
+}
+
+//Calls slot name with the n arguments in the next frame, and stores
+//the result in register dst. ic may be null.
+void reg_call_slot (int name, int dst, int n, InlineCache* ic) {
+  void** args = fsp + 3;
+  VMObj* obj = args[0];
+  if(is_int(obj) || obj->tag == ARRAY_CLASS_TAG){
+    for(int i=0; i<n; i++)
+      vpush(args[i]);
+    if(is_int(obj))
+      call_int_slot(name, n);
+    else
+      call_array_slot(name, n);
+    REG(dst) = vpop();
+    return;
+  }
+  if(obj->tag == NULL_CLASS_TAG){
+    printf("No slot named %s for Null.\n", symbol_name(name));
+    exit(-1);
+  }
+  LSlot* m = ic? ic_lookup(ic, obj) : 0;
+  LSlot s;
+  if(m){
+    ic_stats[CALL_SLOT_INS].hits++;
+  }else{
+    int depth = 0;
+    s = lookup_method(obj, name, &depth);
+    if(ic){
+      ic_stats[CALL_SLOT_INS].misses++;
+      ic_update(ic, obj, s, depth);
+    }
+    m = &s;
+  }
+  reg_push_frame(dst, n, m->code);
+}
+
+//Same as run_loop, for register code.
+void** reg_loop (int get_handlers) {
+#ifdef THREADED_DISPATCH
+  static void* handlers[] = {
+    &&REG_INT_INS_HANDLER,
+    &&REG_NULL_INS_HANDLER,
+    &&REG_MOV_INS_HANDLER,
+    &&REG_PRINTF_INS_HANDLER,
+    &&REG_ARRAY_INS_HANDLER,
+    &&REG_OBJECT_INS_HANDLER,
+    &&REG_SLOT_INS_HANDLER,
+    &&REG_SET_SLOT_INS_HANDLER,
+    &&REG_CALL_SLOT_INS_HANDLER,
+    &&REG_CALL_INS_HANDLER,
+    &&REG_SET_GLOBAL_INS_HANDLER,
+    &&REG_GET_GLOBAL_INS_HANDLER,
+    &&REG_BRANCH_INS_HANDLER,
+    &&REG_GOTO_INS_HANDLER,
+    &&REG_RETURN_INS_HANDLER,
+    &&REG_FRAME_INS_HANDLER,
+    &&REG_EQ_INS_HANDLER,
+    &&REG_LT_INS_HANDLER,
+    &&REG_LE_INS_HANDLER,
+    &&REG_GT_INS_HANDLER,
+    &&REG_GE_INS_HANDLER,
+    &&REG_ADD_INS_HANDLER,
+    &&REG_SUB_INS_HANDLER,
+    &&REG_MUL_INS_HANDLER,
+    &&REG_DIV_INS_HANDLER,
+    &&REG_MOD_INS_HANDLER,
+    &&REG_EQ_IMM_INS_HANDLER,
+    &&REG_LT_IMM_INS_HANDLER,
+    &&REG_LE_IMM_INS_HANDLER,
+    &&REG_GT_IMM_INS_HANDLER,
+    &&REG_GE_IMM_INS_HANDLER,
+    &&REG_ADD_IMM_INS_HANDLER,
+    &&REG_SUB_IMM_INS_HANDLER,
+    &&REG_MUL_IMM_INS_HANDLER,
+    &&REG_DIV_IMM_INS_HANDLER,
+    &&REG_MOD_IMM_INS_HANDLER,
+    &&REG_EQ_BRANCH_INS_HANDLER,
+    &&REG_LT_BRANCH_INS_HANDLER,
+    &&REG_LE_BRANCH_INS_HANDLER,
+    &&REG_GT_BRANCH_INS_HANDLER,
+    &&REG_GE_BRANCH_INS_HANDLER,
+    &&REG_EQ_IMM_BRANCH_INS_HANDLER,
+    &&REG_LT_IMM_BRANCH_INS_HANDLER,
+    &&REG_LE_IMM_BRANCH_INS_HANDLER,
+    &&REG_GT_IMM_BRANCH_INS_HANDLER,
+    &&REG_GE_IMM_BRANCH_INS_HANDLER,
+    &&REG_ARRAY_GET_INS_HANDLER,
+    &&REG_ARRAY_SET_INS_HANDLER,
+    &&REG_ARRAY_LENGTH_INS_HANDLER
+  };
+  if(get_handlers)
+    return handlers;
+  DISPATCH();
+#else
+  if(get_handlers)
+    return 0;
+  while(ip){
+    char tag = next_op();
+    switch(tag){
+#endif
+    CASE(REG_INT_INS) {
+      int dst = next_short();
+      REG(dst) = box_int(next_int());
+      NEXT();
+    }
+    CASE(REG_NULL_INS) {
+      int dst = next_short();
+      REG(dst) = nullobj;
+      NEXT();
+    }
+    CASE(REG_MOV_INS) {
+      int dst = next_short();
+      REG(dst) = REG(next_short());
+      NEXT();
+    }
+    CASE(REG_PRINTF_INS) {
+      int n = next_char();
+      int dst = next_short();
+      char* format = next_ptr();
+      for(int i=0; i<n; i++)
+        vpush(REG(next_short()));
+      print_format(format, n);
+      vsp -= n;
+      REG(dst) = nullobj;
+      NEXT();
+    }
+    CASE(REG_ARRAY_INS) {
+      char* site = ip - OP_WIDTH;
+      int dst = next_short();
+      int len = next_short();
+      int init = next_short();
+      ensure_int(REG(len));
+      int length = unbox_int(REG(len));
+      VMArray* a = alloc_empty_array(site, length);
+      void* x = REG(init);
+      for(int i=0; i<length; i++)
+        a->items[i] = encode_ref(x);
+      REG(dst) = a;
+      NEXT();
+    }
+    CASE(REG_OBJECT_INS) {
+      char* site = ip - OP_WIDTH;
+      int arity = next_char();
+      int class = next_short();
+      int dst = next_short();
+      VMObj* o = alloc_object(site, class, arity);
+      void* parent = REG(next_short());
+      ensure_parent(parent);
+      o->parent = encode_ref(parent);
+      for(int i=0; i<arity; i++)
+        o->slots[i] = encode_ref(REG(next_short()));
+      REG(dst) = o;
+      NEXT();
+    }
+    CASE(REG_SLOT_INS) {
+      int dst = next_short();
+      VMObj* o = REG(next_short());
+      int name = next_int();
+      InlineCache* ic = next_cache();
+      if(is_int(o) || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
+        printf("No variable slot %s for object ", symbol_name(name));
+        print_obj(o);
+        printf(".\n");
+      }
+      LSlot s;
+      LSlot* slot = ic_lookup(ic, o);
+      if(slot){
+        ic_stats[SLOT_INS].hits++;
+      }else{
+        ic_stats[SLOT_INS].misses++;
+        int depth = 0;
+        s = lookup_varslot(o, name, &depth);
+        ic_update(ic, o, s, depth);
+        slot = &s;
+      }
+      REG(dst) = decode_ref(o->slots[slot->idx]);
+      NEXT();
+    }
+    CASE(REG_SET_SLOT_INS) {
+      VMObj* o = REG(next_short());
+      void* x = REG(next_short());
+      int name = next_int();
+      InlineCache* ic = next_cache();
+      if(is_int(o) || o->tag == NULL_CLASS_TAG || o->tag == ARRAY_CLASS_TAG){
+        printf("No variable slot %s for object ", symbol_name(name));
+        print_obj(o);
+        printf(".\n");
+      }
+      LSlot s;
+      LSlot* slot = ic_lookup(ic, o);
+      if(slot){
+        ic_stats[SET_SLOT_INS].hits++;
+      }else{
+        ic_stats[SET_SLOT_INS].misses++;
+        int depth = 0;
+        s = lookup_varslot(o, name, &depth);
+        ic_update(ic, o, s, depth);
+        slot = &s;
+      }
+      write_barrier(o, x);
+      o->slots[slot->idx] = encode_ref(x);
+      NEXT();
+    }
+    CASE(REG_CALL_SLOT_INS) {
+      int n = next_char();
+      int dst = next_short();
+      int name = next_int();
+      InlineCache* ic = next_cache();
+      reg_gather_args(n);
+      reg_call_slot(name, dst, n, ic);
+      NEXT();
+    }
+    CASE(REG_CALL_INS) {
+      int n = next_char();
+      int dst = next_short();
+      void* code = next_ptr();
+      reg_gather_args(n);
+      reg_push_frame(dst, n, code);
+      NEXT();
+    }
+    CASE(REG_SET_GLOBAL_INS) {
+      int idx = next_short();
+      void* x = REG(next_short());
+      global_barrier(idx, x);
+      genv[idx] = x;
+      NEXT();
+    }
+    CASE(REG_GET_GLOBAL_INS) {
+      int dst = next_short();
+      REG(dst) = genv[next_short()];
+      NEXT();
     }
-    case GOTO_INS : {
+    CASE(REG_BRANCH_INS) {
+      VMObj* obj = REG(next_short());
       void* code = next_ptr();
-      //printf("Run Goto(0x%lx)\n", code);
-      ip = code;
-      break;
+      if(is_int(obj) || obj->tag != NULL_CLASS_TAG)
+        ip = code;
+      NEXT();
     }
-    case RETURN_INS : {
-      //printf("Run Return\n");
-      int oldfp = (int)vector_get(fstack, fp + 1);
-      ip = vector_get(fstack, fp);
-      vector_set_length(fstack, fp, nullobj);
-      fp = oldfp;
-      break;
+    CASE(REG_GOTO_INS) {
+      ip = next_ptr();
+      NEXT();
     }
-    case DROP_INS : {
-      //printf("Run Drop\n");
-      vector_pop(vstack);
-      break;
+    CASE(REG_RETURN_INS) {
+      void* x = REG(next_short());
+      int dst = unbox_int(fp[2]);
+      ip = fp[0];
+      fsp = fp;
+      fp = fp[1];
+      if(!ip)
+        return 0;
+      REG(dst) = x;
+      NEXT();
     }
-    case FRAME_INS : {
+    CASE(REG_FRAME_INS) {
       int nargs = next_char();
-      int nlocals = next_short();
-      //printf("Run Frame(%d,%d)\n", nargs, nlocals);
+      int nregs = next_short();
       ensure_arity(n, nargs);
-      vector_set_length(fstack, fp + 2 + nargs + nlocals, nullobj);
-      for(int i=n-1; i>=0; i--)
-        vector_set(fstack, fp + 2 + i, vector_pop(vstack));
-      break;
+      fsp = fp + 3 + nregs;
+      for(int i=nargs; i<nregs; i++)
+        REG(i) = nullobj;
+      NEXT();
+    }
+    //Builtin Int slots. If the receiver is not an Int the slot is
+    //called like any other.
+#define REG_INT_OP(OP, sym, next_y, result)     \
+    CASE(OP) {                                  \
+      int dst = next_short();                   \
+      void* a = REG(next_short());              \
+      void* b = next_y;                         \
+      if(is_int(a) && is_int(b)){               \
+        long x = unbox_int(a);                  \
+        long y = unbox_int(b);                  \
+        REG(dst) = result;                      \
+      }else{                                    \
+        fsp[3] = a;                             \
+        fsp[4] = b;                             \
+        reg_call_slot(sym, dst, 2, 0);          \
+      }                                         \
+      NEXT();                                   \
+    }
+#define REG_INT_OPS(OP, IMM_OP, sym, result)            \
+    REG_INT_OP(OP, sym, REG(next_short()), result)      \
+    REG_INT_OP(IMM_OP, sym, box_int(next_int()), result)
+    REG_INT_OPS(REG_EQ_INS, REG_EQ_IMM_INS, EQ_SYM, BOOL(x == y))
+    REG_INT_OPS(REG_LT_INS, REG_LT_IMM_INS, LT_SYM, BOOL(x < y))
+    REG_INT_OPS(REG_LE_INS, REG_LE_IMM_INS, LE_SYM, BOOL(x <= y))
+    REG_INT_OPS(REG_GT_INS, REG_GT_IMM_INS, GT_SYM, BOOL(x > y))
+    REG_INT_OPS(REG_GE_INS, REG_GE_IMM_INS, GE_SYM, BOOL(x >= y))
+    REG_INT_OPS(REG_ADD_INS, REG_ADD_IMM_INS, ADD_SYM, box_int((int)(x + y)))
+    REG_INT_OPS(REG_SUB_INS, REG_SUB_IMM_INS, SUB_SYM, box_int((int)(x - y)))
+    REG_INT_OPS(REG_MUL_INS, REG_MUL_IMM_INS, MUL_SYM, box_int((int)(x * y)))
+    REG_INT_OPS(REG_DIV_INS, REG_DIV_IMM_INS, DIV_SYM, box_int((int)(x / y)))
+    REG_INT_OPS(REG_MOD_INS, REG_MOD_IMM_INS, MOD_SYM, box_int((int)(x % y)))
+    //Comparisons followed by a branch. The branch is skipped when both
+    //operands are Ints. Otherwise the slot is called with the result
+    //going to the register that the branch tests.
+#define REG_BRANCH_OP(OP, sym, next_y, test)    \
+    CASE(OP) {                                  \
+      void* a = REG(next_short());              \
+      void* b = next_y;                         \
+      if(is_int(a) && is_int(b)){               \
+        long x = unbox_int(a);                  \
+        long y = unbox_int(b);                  \
+        next_op();                              \
+        next_short();                           \
+        void* code = next_ptr();                \
+        if(test)                                \
+          ip = code;                            \
+      }else{                                    \
+        char* branch = ip;                      \
+        next_op();                              \
+        int dst = next_short();                 \
+        ip = branch;                            \
+        fsp[3] = a;                             \
+        fsp[4] = b;                             \
+        reg_call_slot(sym, dst, 2, 0);          \
+      }                                         \
+      NEXT();                                   \
+    }
+#define REG_BRANCH_OPS(OP, IMM_OP, sym, test)           \
+    REG_BRANCH_OP(OP, sym, REG(next_short()), test)     \
+    REG_BRANCH_OP(IMM_OP, sym, box_int(next_int()), test)
+    REG_BRANCH_OPS(REG_EQ_BRANCH_INS, REG_EQ_IMM_BRANCH_INS, EQ_SYM, x == y)
+    REG_BRANCH_OPS(REG_LT_BRANCH_INS, REG_LT_IMM_BRANCH_INS, LT_SYM, x < y)
+    REG_BRANCH_OPS(REG_LE_BRANCH_INS, REG_LE_IMM_BRANCH_INS, LE_SYM, x <= y)
+    REG_BRANCH_OPS(REG_GT_BRANCH_INS, REG_GT_IMM_BRANCH_INS, GT_SYM, x > y)
+    REG_BRANCH_OPS(REG_GE_BRANCH_INS, REG_GE_IMM_BRANCH_INS, GE_SYM, x >= y)
+    CASE(REG_ARRAY_GET_INS) {
+      int dst = next_short();
+      VMArray* a = REG(next_short());
+      void* i = REG(next_short());
+      if(is_array(a)){
+        ensure_index(i, a);
+        REG(dst) = decode_ref(a->items[unbox_int(i)]);
+      }else{
+        fsp[3] = a;
+        fsp[4] = i;
+        reg_call_slot(GET_SYM, dst, 2, 0);
+      }
+      NEXT();
+    }
+    CASE(REG_ARRAY_SET_INS) {
+      int dst = next_short();
+      VMArray* a = REG(next_short());
+      void* i = REG(next_short());
+      void* x = REG(next_short());
+      if(is_array(a)){
+        ensure_index(i, a);
+        write_barrier(a, x);
+        a->items[unbox_int(i)] = encode_ref(x);
+        REG(dst) = nullobj;
+      }else{
+        fsp[3] = a;
+        fsp[4] = i;
+        fsp[5] = x;
+        reg_call_slot(SET_SYM, dst, 3, 0);
+      }
+      NEXT();
+    }
+    CASE(REG_ARRAY_LENGTH_INS) {
+      int dst = next_short();
+      VMArray* a = REG(next_short());
+      if(is_array(a)){
+        REG(dst) = box_int(a->length);
+      }else{
+        fsp[3] = a;
+        reg_call_slot(LENGTH_SYM, dst, 1, 0);
+      }
+      NEXT();
     }
+#ifndef THREADED_DISPATCH
     default:
       printf("Unknown tag: %d\n", tag);
       exit(-1);
     }
-  }  
+  }
+#endif
+  return 0;
 }
 
-void push_bool (int bool) {
-  if(bool)
-    vector_add(vstack, zeroobj);
-  else
-    vector_add(vstack, nullobj);  
+//The method cache is shared by all call sites and is consulted
+//before the slot tables. It is direct mapped on (class tag, name) and
+//uses the same entries as the inline caches. Classes never change
+//after linking, so entries never have to be invalidated.
+#define METHOD_CACHE_SIZE 1024
+
+ICEntry method_cache[METHOD_CACHE_SIZE];
+ICStats method_cache_stats;
+
+void init_method_cache () {
+  for(int i=0; i<METHOD_CACHE_SIZE; i++)
+    method_cache[i].tag = -1;
 }
 
-void push_int (int r) {
-  vector_add(vstack, alloc_int(r));
+LSlot cached_lookup_slot (VMObj* obj, int name, int* depth) {
+  int h = (hash_sym(name) ^ (int)obj->tag) & (METHOD_CACHE_SIZE - 1);
+  ICEntry* e = &method_cache[h];
+  if(e->tag == obj->tag && e->slot.name == name){
+    if(e->parent_tag < 0){
+      method_cache_stats.hits++;
+      *depth = 0;
+      return e->slot;
+    }
+    if(e->parent_tag == ((VMObj*)decode_ref(obj->parent))->tag){
+      method_cache_stats.hits++;
+      *depth = 1;
+      return e->slot;
+    }
+  }
+  method_cache_stats.misses++;
+  LSlot s = lookup_slot(obj, name, depth);
+  if(*depth <= 1){
+    e->tag = obj->tag;
+    e->parent_tag = *depth == 0? -1 : ((VMObj*)decode_ref(obj->parent))->tag;
+    e->slot = s;
+  }
+  return s;
 }
 
-void call_int_slot (char* slotname, int n) {
-  ensure_arity(n, 2);
-  VMInt* y = vector_pop(vstack);
-  VMInt* x = vector_pop(vstack);
-  ensure_int(y);
-  if(strcmp(slotname, "eq") == 0)
-    push_bool(x->value == y->value);
-  else if(strcmp(slotname, "lt") == 0)
-    push_bool(x->value < y->value);
-  else if(strcmp(slotname, "le") == 0)
-    push_bool(x->value <= y->value);
-  else if(strcmp(slotname, "gt") == 0)
-    push_bool(x->value > y->value);
-  else if(strcmp(slotname, "ge") == 0)
-    push_bool(x->value >= y->value);
-  else if(strcmp(slotname, "add") == 0)
-    push_int(x->value + y->value);
-  else if(strcmp(slotname, "sub") == 0)
-    push_int(x->value - y->value);
-  else if(strcmp(slotname, "mul") == 0)
-    push_int(x->value * y->value);
-  else if(strcmp(slotname, "div") == 0)
-    push_int(x->value / y->value);
-  else if(strcmp(slotname, "mod") == 0)
-    push_int(x->value % y->value);
-  else{
-    printf("No slot named %s for Int.\n", slotname);
+//Depth is incremented once for every parent that is searched.
+LSlot lookup_slot (VMObj* obj, int name, int* depth) {
+  if(obj->tag == NULL_CLASS_TAG){
+    printf("No slot %s for Null.\n", symbol_name(name));
     exit(-1);
+  }else{
+    LClass* c = vector_get(classes, obj->tag);
+    LSlot* s = find_slot(c, name);
+    if(s)
+      return *s;
+    (*depth)++;
+    return lookup_slot(decode_ref(obj->parent), name, depth);
   }
 }
 
-void call_array_slot (char* slotname, int n) {
-  if(strcmp(slotname, "get") == 0){
-    ensure_arity(n, 2);
-    VMInt* i = vector_pop(vstack);
-    VMArray* a = vector_pop(vstack);
-    ensure_index(i, a);
-    vector_add(vstack, a->items[i->value]);
+LSlot lookup_method (VMObj* obj, int name, int* depth) {
+  LSlot s = cached_lookup_slot(obj, name, depth);
+  if(s.tag != CODE_SLOT){
+    printf("Slot %s is not a method slot.\n", symbol_name(name));
+    exit(-1);
   }
-  else if(strcmp(slotname, "set") == 0){
-    ensure_arity(n, 3);
-    void* v = vector_pop(vstack);
-    VMInt* i = vector_pop(vstack);
-    VMArray* a = vector_pop(vstack);
-    ensure_index(i, a);
-    a->items[i->value] = v;
-    vector_add(vstack, nullobj);
+  return s;
+}
+
+LSlot lookup_varslot (VMObj* obj, int name, int* depth) {
+  LSlot s = cached_lookup_slot(obj, name, depth);
+  if(s.tag != VAR_SLOT){
+    printf("Slot %s is not a variable slot.\n", symbol_name(name));
+    exit(-1);
   }
-  else if(strcmp(slotname, "length") == 0){
-    ensure_arity(n, 1);
-    VMArray* a = vector_pop(vstack);
-    push_int(a->length);
+  return s;
+}
+
+//============================================================
+//===================== INLINE CACHES ========================
+//============================================================
+
+//Every SLOT_INS, SET_SLOT_INS and CALL_SLOT_INS carries an
+//InlineCache in the code buffer. A cache starts empty, holds up to
+//IC_SIZE receiver classes, and turns megamorphic on the next miss,
+//after which it is no longer consulted or updated.
+
+int opt_ic_stats;
+
+LSlot* ic_lookup (InlineCache* ic, VMObj* obj) {
+  for(int i=0; i<ic->n; i++){
+    ICEntry* e = &ic->entries[i];
+    if(e->tag == obj->tag)
+      if(e->parent_tag < 0 || e->parent_tag == ((VMObj*)decode_ref(obj->parent))->tag)
+        return &e->slot;
   }
-  else{
-    printf("No slot named %s for Array.\n", slotname);
+  return 0;
+}
+
+void ic_update (InlineCache* ic, VMObj* obj, LSlot s, int depth) {
+  //Slots found further up the parent chain are not cached
+  if(ic->n == IC_MEGAMORPHIC || depth > 1)
+    return;
+  if(ic->n == IC_SIZE){
+    ic->n = IC_MEGAMORPHIC;
+    return;
+  }
+  ICEntry* e = &ic->entries[ic->n];
+  e->tag = obj->tag;
+  e->parent_tag = depth == 0? -1 : ((VMObj*)decode_ref(obj->parent))->tag;
+  e->slot = s;
+  ic->n++;
+}
+
+void print_ic_stats () {
+  int nempty = 0;
+  int nmono = 0;
+  int npoly = 0;
+  int nmega = 0;
+  for(int i=0; i<caches->size; i++){
+    InlineCache* ic = (InlineCache*)(code + (long)vector_get(caches, i));
+    if(ic->n == IC_MEGAMORPHIC) nmega++;
+    else if(ic->n == 0) nempty++;
+    else if(ic->n == 1) nmono++;
+    else npoly++;
+  }
+  printf("Inline caches:\n");
+  printf("   slot: %ld hits, %ld misses\n",
+         ic_stats[SLOT_INS].hits, ic_stats[SLOT_INS].misses);
+  printf("   set-slot: %ld hits, %ld misses\n",
+         ic_stats[SET_SLOT_INS].hits, ic_stats[SET_SLOT_INS].misses);
+  printf("   call-slot: %ld hits, %ld misses\n",
+         ic_stats[CALL_SLOT_INS].hits, ic_stats[CALL_SLOT_INS].misses);
+  printf("   sites: %d unused, %d monomorphic, %d polymorphic, %d megamorphic\n",
+         nempty, nmono, npoly, nmega);
+  printf("Method cache: %ld hits, %ld misses\n",
+         method_cache_stats.hits, method_cache_stats.misses);
+}
+
+//============================================================
+//===================== DISASSEMBLER =========================
+//============================================================
+
+int opt_disasm;
+
+char* op_names[] = {
+  "int",
+  "null",
+  "printf",
+  "array",
+  "object",
+  "slot",
+  "set-slot",
+  "call-slot",
+  "call",
+  "set local",
+  "get local",
+  "set global",
+  "get global",
+  "branch",
+  "goto",
+  "return",
+  "drop",
+  "frame",
+  "int-eq",
+  "int-lt",
+  "int-le",
+  "int-gt",
+  "int-ge",
+  "int-add",
+  "int-sub",
+  "int-mul",
+  "int-div",
+  "int-mod",
+  "array-get",
+  "array-set",
+  "array-length",
+  "get local2",
+  "get local int",
+  "set local drop",
+  "set global drop",
+  "int-eq-branch",
+  "int-lt-branch",
+  "int-le-branch",
+  "int-gt-branch",
+  "int-ge-branch"
+};
+
+void print_cache_state (InlineCache* ic) {
+  if(ic->n == IC_MEGAMORPHIC)
+    printf(" (megamorphic)");
+  else if(ic->n > 0)
+    printf(" (%ld cached)", ic->n);
+}
+
+//Returns the address of the instruction at or after p.
+char* align_op (char* p) {
+#ifdef THREADED_DISPATCH
+  p = (char*)(((long)p + 7)&(-8));
+#endif
+  return p;
+}
+
+//Prints the instruction at ip, without a newline, and moves ip past
+//it. Returns 0 if there is no valid instruction at ip.
+int print_linked_ins () {
+  int op = op_at(ip);
+  next_op();
+  if(op < 0 || op >= NUM_OPS){
+    printf("unknown");
+    return 0;
+  }
+  printf("%s", op_names[op]);
+  switch(op){
+  case INT_INS:
+    printf(" %d", next_int());
+    break;
+  case PRINTF_INS:{
+    int arity = next_char();
+    printf(" ");
+    print_string(next_ptr());
+    printf(" %d", arity);
+    break;
+  }
+  case OBJECT_INS:{
+    int arity = next_char();
+    printf(" class:%d arity:%d", next_short(), arity);
+    break;
+  }
+  case SLOT_INS:
+  case SET_SLOT_INS:
+    printf(" %s", symbol_name(next_int()));
+    print_cache_state(next_cache());
+    break;
+  case CALL_INS:{
+    int arity = next_char();
+    printf(" %ld %d", (long)((char*)next_ptr() - code), arity);
+    break;
+  }
+  case SET_LOCAL_INS:
+  case GET_LOCAL_INS:
+  case SET_GLOBAL_INS:
+  case GET_GLOBAL_INS:
+    printf(" %d", next_short());
+    break;
+  case BRANCH_INS:
+  case GOTO_INS:
+    printf(" %ld", (long)((char*)next_ptr() - code));
+    break;
+  case FRAME_INS:{
+    int nargs = next_char();
+    printf(" nargs:%d nlocals:%d", nargs, next_short());
+    break;
+  }
+  case GET_LOCAL2_INS:{
+    int idx1 = next_short();
+    printf(" %d %d", idx1, next_short());
+    break;
+  }
+  case GET_LOCAL_INT_INS:{
+    int idx = next_short();
+    printf(" %d %d", idx, next_int());
+    break;
+  }
+  case SET_LOCAL_DROP_INS:
+  case SET_GLOBAL_DROP_INS:
+    printf(" %d", next_short());
+    break;
+  default:
+    if(op == CALL_SLOT_INS || op >= INT_EQ_INS){
+      //Covers the quickened forms, which share its layout
+      int arity = next_char();
+      printf(" %s %d", symbol_name(next_int()), arity);
+      print_cache_state(next_cache());
+    }
+    break;
+  }
+  return 1;
+}
+
+//Prints the linked code, including any instructions that have been
+//quickened by the interpreter.
+void print_code () {
+  char* saved_ip = ip;
+  ip = code;
+  printf("Code :\n");
+  while(ip < codep){
+    ip = align_op(ip);
+    if(op_at(ip) == FRAME_INS)
+      printf("\n");
+    printf("   %ld: ", (long)(ip - code));
+    int ok = print_linked_ins();
+    printf("\n");
+    if(!ok)
+      break;
+  }
+  ip = saved_ip;
+}
+
+//============================================================
+//======================= PROFILER ===========================
+//============================================================
+
+//In threaded builds, profiling links every instruction to a single
+//counting handler, which looks up the real opcode in op_map. Runs
+//that do not profile pay nothing for it.
+//
+//With -profile, op_hits also counts the executions of each
+//instruction by its offset in the code buffer, and prof_stack follows
+//the calls from the frame and return instructions. A method is
+//identified by the range of code that starts at its frame
+//instruction. Its self count is the number of instructions executed
+//in that range, and its inclusive count also has the instructions of
+//the methods it called. Recursive calls are only counted once towards
+//the inclusive count.
+
+char* opt_pair_profile;
+int opt_profile;
+long pair_counts[NUM_OPS][NUM_OPS];
+int last_op;
+
+typedef struct {
+  MethodValue* value;
+  char* name;
+  int idx;
+  long* ins_pos;
+  long start;
+  long end;
+  long calls;
+  long self;
+  long inclusive;
+  int active;
+} ProfMethod;
+
+typedef struct {
+  int method;
+  long entry;
+} ProfFrame;
+
+ProfMethod* prof_methods;
+int nprof_methods;
+ProfFrame* prof_stack;
+int prof_sp;
+int prof_stack_cap;
+long* op_hits;
+long executed_ops;
+
+//Called by the linker just before each method is linked.
+void add_profile_method (MethodValue* v, char* name, int idx) {
+  prof_methods = realloc(prof_methods, sizeof(ProfMethod) * (nprof_methods + 1));
+  ProfMethod* m = &prof_methods[nprof_methods++];
+  memset(m, 0, sizeof(ProfMethod));
+  m->value = v;
+  m->name = name;
+  m->idx = idx;
+  m->ins_pos = calloc(v->code->size, sizeof(long));
+  m->start = codep - code;
+}
+
+//Records that the n bytecode instructions from i were linked into the
+//instruction at pos, so that the annotated code can show their counts.
+void set_profile_pos (int i, int n, long pos) {
+  ProfMethod* m = &prof_methods[nprof_methods - 1];
+  for(int j=i; j<i+n; j++)
+    m->ins_pos[j] = align_op(code + pos) - code;
+}
+
+//Called by initvm once the code is linked. Methods are linked in
+//order, so each one ends where the next one starts.
+void init_profile () {
+  for(int i=0; i<nprof_methods; i++)
+    prof_methods[i].end = i + 1 < nprof_methods? prof_methods[i + 1].start : codep - code;
+  op_hits = calloc(codep - code, sizeof(long));
+}
+
+int method_at (long pos) {
+  int lo = 0;
+  int hi = nprof_methods - 1;
+  while(lo < hi){
+    int mid = (lo + hi + 1) / 2;
+    if(prof_methods[mid].start <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+void enter_method (long pos) {
+  if(opt_perf)
+    perf_sample();
+  int i = method_at(pos);
+  prof_methods[i].calls++;
+  prof_methods[i].active++;
+  if(prof_sp == prof_stack_cap){
+    prof_stack_cap = prof_stack_cap * 2 + 64;
+    prof_stack = realloc(prof_stack, sizeof(ProfFrame) * prof_stack_cap);
+  }
+  prof_stack[prof_sp].method = i;
+  prof_stack[prof_sp].entry = executed_ops;
+  prof_sp++;
+}
+
+void leave_method () {
+  if(prof_sp == 0)
+    return;
+  if(opt_perf)
+    perf_sample();
+  ProfFrame* f = &prof_stack[--prof_sp];
+  ProfMethod* m = &prof_methods[f->method];
+  if(--m->active == 0)
+    m->inclusive += executed_ops - f->entry;
+}
+
+void trace_call (long pos, int op);
+
+//Counts the instruction op at p.
+void count_op (char* p, int op) {
+  pair_counts[last_op][op]++;
+  last_op = op;
+  if(opt_trace_calls && (op == FRAME_INS || op == RETURN_INS))
+    trace_call(p - code, op);
+  if(opt_profile){
+    long pos = p - code;
+    if(op == FRAME_INS)
+      enter_method(pos);
+    executed_ops++;
+    op_hits[pos]++;
+    if(op == RETURN_INS)
+      leave_method();
+  }
+}
+
+#ifdef THREADED_DISPATCH
+//Called by the counting handler. Counts the instruction, and then
+//temporarily patches in its real handler and rewinds ip so that it
+//is dispatched to next. The patch is undone when the following
+//instruction is counted.
+void profile_op () {
+  if(profile_patch)
+    profile_patch[0] = op_handlers[NUM_OPS];
+  ip = current_op();
+  int op = op_map[ip - code];
+  count_op(ip, op);
+  profile_patch = (void**)ip;
+  profile_patch[0] = op_handlers[op];
+}
+#endif
+
+void write_pair_profile (char* filename) {
+  FILE* f = fopen(filename, "w");
+  if(!f){
+    printf("Could not write file %s.\n", filename);
     exit(-1);
   }
+  for(int i=0; i<NUM_OPS; i++)
+    for(int j=0; j<NUM_OPS; j++)
+      if(pair_counts[i][j] > 0)
+        fprintf(f, "%d %d %ld\t%s -> %s\n", i, j, pair_counts[i][j],
+                op_names[i], op_names[j]);
+  fclose(f);
 }
 
-LSlot lookup_slot (VMObj* obj, char* name) {
-  if(obj->tag == NULL_CLASS_TAG){
-    printf("No slot %s for Null.\n", name);
+//Sorts the indices in order of decreasing counts.
+long* sort_counts;
+
+int compare_counts (const void* a, const void* b) {
+  long x = sort_counts[*(int*)a];
+  long y = sort_counts[*(int*)b];
+  return (x < y) - (x > y);
+}
+
+void sort_by_counts (int* order, long* counts, int n) {
+  for(int i=0; i<n; i++)
+    order[i] = i;
+  sort_counts = counts;
+  qsort(order, n, sizeof(int), compare_counts);
+}
+
+double percent (long x, long total) {
+  return total > 0? 100.0 * x / total : 0;
+}
+
+#define PROFILE_TOP_PAIRS 20
+
+void print_profile () {
+  //Methods still running when the program ended
+  while(prof_sp > 0)
+    leave_method();
+  long total = executed_ops;
+  printf("Profile: %ld instructions\n", total);
+
+  long op_counts[NUM_OPS] = {0};
+  for(int i=0; i<NUM_OPS; i++)
+    for(int j=0; j<NUM_OPS; j++)
+      op_counts[j] += pair_counts[i][j];
+  int ops[NUM_OPS];
+  sort_by_counts(ops, op_counts, NUM_OPS);
+  printf("Opcodes :\n");
+  for(int i=0; i<NUM_OPS && op_counts[ops[i]] > 0; i++)
+    printf("   %12ld %5.1f%%  %s\n", op_counts[ops[i]],
+           percent(op_counts[ops[i]], total), op_names[ops[i]]);
+
+  long* pairs = (long*)pair_counts;
+  int* order = malloc(sizeof(int) * NUM_OPS * NUM_OPS);
+  sort_by_counts(order, pairs, NUM_OPS * NUM_OPS);
+  printf("Opcode pairs :\n");
+  for(int i=0; i<PROFILE_TOP_PAIRS && pairs[order[i]] > 0; i++)
+    printf("   %12ld %5.1f%%  %s -> %s\n", pairs[order[i]],
+           percent(pairs[order[i]], total),
+           op_names[order[i] / NUM_OPS], op_names[order[i] % NUM_OPS]);
+  free(order);
+
+  long* inclusive = malloc(sizeof(long) * nprof_methods);
+  for(int i=0; i<nprof_methods; i++){
+    ProfMethod* m = &prof_methods[i];
+    for(long p=m->start; p<m->end; p++)
+      m->self += op_hits[p];
+    inclusive[i] = m->inclusive;
+  }
+  int* methods = malloc(sizeof(int) * nprof_methods);
+  sort_by_counts(methods, inclusive, nprof_methods);
+  printf("Methods :\n");
+  printf("   %10s %12s %6s %12s %6s  %s\n",
+         "calls", "self", "", "inclusive", "", "method");
+  for(int i=0; i<nprof_methods; i++){
+    ProfMethod* m = &prof_methods[methods[i]];
+    if(m->calls == 0)
+      continue;
+    printf("   %10ld %12ld %5.1f%% %12ld %5.1f%%  %s #%d\n", m->calls,
+           m->self, percent(m->self, total),
+           m->inclusive, percent(m->inclusive, total), m->name, m->idx);
+  }
+
+  //Bytecode of the methods that ran, with the number of times each
+  //instruction was executed. Instructions that were fused into a
+  //superinstruction share its count.
+  printf("Annotated code :\n");
+  for(int i=0; i<nprof_methods; i++){
+    ProfMethod* m = &prof_methods[methods[i]];
+    if(m->calls == 0)
+      continue;
+    printf("\n   %s #%d:\n", m->name, m->idx);
+    Vector* body = m->value->code;
+    for(int j=0; j<body->size; j++){
+      ByteIns* ins = vector_get(body, j);
+      if(ins->tag == LABEL_OP)
+        printf("   %12s ", "");
+      else
+        printf("   %12ld ", op_hits[m->ins_pos[j]]);
+      print_ins(ins);
+      printf("\n");
+    }
+  }
+  free(methods);
+  free(inclusive);
+}
+
+//============================================================
+//=================== SAMPLING PROFILER ======================
+//============================================================
+
+//With -sample <file>, a timer sends SIGPROF sample_rate times per
+//second (-samplerate, default 1000) of wall-clock time. It runs on
+//CLOCK_MONOTONIC, since timers on CPU time only fire on the kernel
+//tick, which is usually slower than that, so time spent blocked is
+//sampled as well. The handler walks the frame chain from fp,
+//following the return address in fp[0] and the caller's frame in
+//fp[1], and appends the method of ip and of every return address to
+//sample_buf. Each sample is stored as its depth followed by the method
+//indices, innermost first. Nothing is allocated in the handler, so
+//samples that do not fit in sample_buf are dropped.
+//
+//On exit the samples are merged and written as folded stacks, one
+//line per distinct stack with the methods from the outermost to the
+//innermost separated by semicolons and followed by the number of
+//samples, which flame graph tools read directly. Methods are known by
+//name, with their index added if several methods share the name. A
+//sample taken in the middle of a call or return can show the caller
+//twice.
+#define MAX_SAMPLE_DEPTH 256
+#define SAMPLE_BUF_INTS (16L * 1024 * 1024)
+
+char* opt_sample;
+char* opt_sample_rate;
+timer_t sample_timer;
+int* sample_buf;
+long nsample_ints;
+long nsamples;
+long dropped_samples;
+
+//Returns the index of the method whose code contains p, or -1.
+int sample_method (char* p) {
+  if(p < code || p >= codep || nprof_methods == 0)
+    return -1;
+  return method_at(p - code);
+}
+
+void take_sample (int sig) {
+  if(nsample_ints + MAX_SAMPLE_DEPTH + 2 > SAMPLE_BUF_INTS){
+    dropped_samples++;
+    return;
+  }
+  int* s = sample_buf + nsample_ints;
+  int depth = 0;
+  char* p = ip;
+  void** f = fp;
+  //Frames are only trusted if they lie in fstack below the previous one
+  while(depth < MAX_SAMPLE_DEPTH){
+    int m = sample_method(p);
+    if(m < 0)
+      break;
+    s[1 + depth++] = m;
+    if(f < fstack || f >= fstack + STACK_SLOTS)
+      break;
+    p = f[0];
+    void** caller = f[1];
+    if(caller >= f)
+      break;
+    f = caller;
+  }
+  if(depth == 0)
+    return;
+  //A full sample is marked as truncated at its root
+  if(depth == MAX_SAMPLE_DEPTH)
+    s[depth++] = -1;
+  s[0] = depth;
+  nsample_ints += depth + 1;
+  nsamples++;
+}
+
+void start_sampling () {
+  long rate = opt_sample_rate? atol(opt_sample_rate) : 1000;
+  if(rate <= 0 || rate > 1000000){
+    printf("Invalid sample rate: %s\n", opt_sample_rate);
     exit(-1);
-  }else{
-    LClass* c = vector_get(classes, obj->tag);
-    for(int i=0; i<c->nslots; i++){
-      LSlot s = c->slots[i];
-      if(strcmp(s.name, name) == 0)
-        return s;
+  }
+  sample_buf = (int*)mmap(0, sizeof(int) * SAMPLE_BUF_INTS, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(sample_buf == MAP_FAILED){
+    printf("Out of Memory.\n");
+    exit(-1);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = take_sample;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, 0);
+  struct sigevent ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.sigev_notify = SIGEV_SIGNAL;
+  ev.sigev_signo = SIGPROF;
+  if(timer_create(CLOCK_MONOTONIC, &ev, &sample_timer) != 0){
+    printf("Could not create the sampling timer.\n");
+    exit(-1);
+  }
+  long period = 1000000000L / rate;
+  struct itimerspec timer;
+  timer.it_interval.tv_sec = period / 1000000000L;
+  timer.it_interval.tv_nsec = period % 1000000000L;
+  timer.it_value = timer.it_interval;
+  if(timer_settime(sample_timer, 0, &timer, 0) != 0){
+    printf("Could not start the sampling timer.\n");
+    exit(-1);
+  }
+}
+
+void stop_sampling () {
+  timer_delete(sample_timer);
+  signal(SIGPROF, SIG_IGN);
+}
+
+int compare_samples (const void* a, const void* b) {
+  int* x = sample_buf + *(long*)a;
+  int* y = sample_buf + *(long*)b;
+  if(x[0] != y[0])
+    return x[0] - y[0];
+  for(int i=1; i<=x[0]; i++)
+    if(x[i] != y[i])
+      return x[i] - y[i];
+  return 0;
+}
+
+void print_sample_frame (FILE* f, int m) {
+  if(m < 0){
+    fprintf(f, "[truncated]");
+    return;
+  }
+  ProfMethod* pm = &prof_methods[m];
+  fprintf(f, "%s", pm->name);
+  for(int i=0; i<nprof_methods; i++)
+    if(i != m && strcmp(prof_methods[i].name, pm->name) == 0){
+      fprintf(f, "#%d", pm->idx);
+      break;
+    }
+}
+
+void write_samples (char* filename) {
+  FILE* f = fopen(filename, "w");
+  if(!f){
+    printf("Could not write file %s.\n", filename);
+    exit(-1);
+  }
+  long* order = malloc(sizeof(long) * (nsamples + 1));
+  long n = 0;
+  for(long p=0; p<nsample_ints; p+=sample_buf[p]+1)
+    order[n++] = p;
+  qsort(order, n, sizeof(long), compare_samples);
+  for(long i=0; i<n; ){
+    long j = i + 1;
+    while(j < n && compare_samples(&order[i], &order[j]) == 0)
+      j++;
+    int* s = sample_buf + order[i];
+    for(int k=s[0]; k>=1; k--){
+      print_sample_frame(f, s[k]);
+      if(k > 1)
+        fprintf(f, ";");
     }
-    return lookup_slot(obj->parent, name);
+    fprintf(f, " %ld\n", j - i);
+    i = j;
   }
+  if(dropped_samples > 0)
+    fprintf(stderr, "Dropped %ld samples.\n", dropped_samples);
+  free(order);
+  fclose(f);
 }
 
-LSlot lookup_method (VMObj* obj, char* name) {
-  LSlot s = lookup_slot(obj, name);
-  if(s.tag != CODE_SLOT){
-    printf("Slot %s is not a method slot.\n", name);
+//============================================================
+//======================== TRACING ===========================
+//============================================================
+
+//With -trace <file>, or FEENY_TRACE, the phases of a run are written
+//to file as a JSON array of Chrome trace events, which can be opened
+//in chrome://tracing or Perfetto. Every phase is a complete event
+//("ph": "X") with its start and length in microseconds since the
+//trace was started:
+//- startup: loading, printing and linking the program, with the link
+//  broken down into code, classes, globals and patches, and initvm.
+//- run: runvm.
+//- gc: each collection pause, with its kind and byte counts.
+//- call: with -tracecalls, each call made by the entry method, that
+//  is every top-level call, named after the called method. It runs
+//  with the profiler's counting handler, so it slows the program
+//  down.
+char* opt_trace;
+int opt_trace_calls;
+FILE* trace_file;
+double trace_origin;
+int trace_events;
+int call_depth;
+double call_start;
+int call_method;
+
+void start_trace () {
+  if(!opt_trace)
+    opt_trace = getenv("FEENY_TRACE");
+  if(opt_trace_calls && !opt_trace){
+    printf("-tracecalls needs -trace.\n");
     exit(-1);
   }
-  return s;
+  if(!opt_trace)
+    return;
+  trace_file = fopen(opt_trace, "w");
+  if(!trace_file){
+    printf("Could not write file %s.\n", opt_trace);
+    exit(-1);
+  }
+  trace_origin = now_ms();
+  fprintf(trace_file, "[\n");
 }
 
-LSlot lookup_varslot (VMObj* obj, char* name) {
-  LSlot s = lookup_slot(obj, name);
-  if(s.tag != VAR_SLOT){
-    printf("Slot %s is not a variable slot.\n", name);
+//Writes a complete event from start to end, in milliseconds. args is
+//the body of the JSON object of arguments, or 0.
+void write_trace_event (char* name, char* cat, double start, double end, char* args) {
+  if(!trace_file)
+    return;
+  fprintf(trace_file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+          "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1",
+          trace_events++ > 0? ",\n" : "", name, cat,
+          (start - trace_origin) * 1e3, (end - start) * 1e3);
+  if(args)
+    fprintf(trace_file, ", \"args\": {%s}", args);
+  fprintf(trace_file, "}");
+}
+
+//Traces a phase that started at start and ends now.
+void trace_phase (char* name, char* cat, double start) {
+  write_trace_event(name, cat, start, now_ms(), 0);
+}
+
+void trace_gc_event (GCEvent* e, double start, double end) {
+  if(!trace_file)
+    return;
+  char args[256];
+  sprintf(args, "\"before\": %ld, \"live\": %ld, \"copied\": %ld",
+          e->before, e->live, e->copied);
+  write_trace_event(e->kind, "gc", start, end, args);
+}
+
+//Called by count_op on every frame and return instruction. The entry
+//method runs at depth 1, so the top-level calls start at depth 2.
+void trace_call (long pos, int op) {
+  if(op == FRAME_INS){
+    if(++call_depth == 2){
+      call_start = now_ms();
+      call_method = method_at(pos);
+    }
+  }else{
+    if(call_depth-- == 2)
+      write_trace_event(prof_methods[call_method].name, "call", call_start, now_ms(), 0);
+  }
+}
+
+void finish_trace () {
+  if(!trace_file)
+    return;
+  fprintf(trace_file, "\n]\n");
+  fclose(trace_file);
+}
+
+//============================================================
+//================= PERFORMANCE COUNTERS =====================
+//============================================================
+
+//With -perf, hardware and software counters are read with
+//perf_event_open for the user space of this process. The counters are
+//read whenever the phase changes, and the difference is added to the
+//phase that just ended: loading, linking, initvm, running the
+//program, and the GC pauses, which begin_pause and record_pause
+//delimit. With -profile, they are also read on every frame and return
+//instruction and added to the method on top of prof_stack, leaving out
+//the GC pauses. Those counts include the work of the counting handler,
+//so they are only good for comparing the methods with each other.
+//
+//The hardware and the software counters each form a group that is read
+//with a single system call. A group is scheduled as a whole, so if the
+//kernel multiplexes it with other events, the counts are scaled by the
+//share of the time it ran. Counters that cannot be opened, for example
+//in a virtual machine without a PMU, are reported as n/a.
+typedef enum {
+  CYCLES_EVENT,
+  INSTRUCTIONS_EVENT,
+  BRANCH_MISSES_EVENT,
+  L1D_MISSES_EVENT,
+  LLC_MISSES_EVENT,
+  DTLB_MISSES_EVENT,
+  TASK_CLOCK_EVENT,
+  PAGE_FAULTS_EVENT,
+  NUM_PERF_EVENTS
+} PerfEvent;
+
+#define CACHE_MISS_CONFIG(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct {
+  char* name;
+  int type;
+  long config;
+} PerfEventDef;
+
+PerfEventDef perf_events[NUM_PERF_EVENTS] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"L1d-misses", PERF_TYPE_HW_CACHE, CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_L1D)},
+  {"LLC-misses", PERF_TYPE_HW_CACHE, CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_LL)},
+  {"dTLB-misses", PERF_TYPE_HW_CACHE, CACHE_MISS_CONFIG(PERF_COUNT_HW_CACHE_DTLB)},
+  {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+};
+
+char* perf_phase_names[NUM_PERF_PHASES] = {"load", "link", "init", "run", "gc"};
+
+#define NUM_PERF_GROUPS 2
+#define PERF_TOP_METHODS 20
+
+int opt_perf;
+int perf_fd[NUM_PERF_EVENTS];
+int perf_group_leader[NUM_PERF_GROUPS];
+//The events of each group in the order the kernel reports them
+int perf_group_events[NUM_PERF_GROUPS][NUM_PERF_EVENTS];
+int perf_group_size[NUM_PERF_GROUPS];
+int perf_counted[NUM_PERF_EVENTS];
+double perf_last[NUM_PERF_EVENTS];
+double perf_phase_counts[NUM_PERF_PHASES][NUM_PERF_EVENTS];
+PerfPhase perf_current;
+double* method_perf;
+
+int open_perf_event (PerfEventDef* def, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = def->type;
+  attr.config = def->config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+//Reads the scaled value of every counter into values.
+void read_perf (double* values) {
+  unsigned long buf[3 + NUM_PERF_EVENTS];
+  for(int g=0; g<NUM_PERF_GROUPS; g++){
+    if(perf_group_leader[g] < 0)
+      continue;
+    if(read(perf_group_leader[g], buf, sizeof(buf)) <= 0)
+      continue;
+    double scale = buf[2] > 0? (double)buf[1] / buf[2] : 0;
+    for(int i=0; i<perf_group_size[g]; i++){
+      int e = perf_group_events[g][i];
+      values[e] = buf[3 + i] * scale;
+      if(buf[2] > 0)
+        perf_counted[e] = 1;
+    }
+  }
+}
+
+void start_perf () {
+  if(!opt_perf)
+    return;
+  for(int g=0; g<NUM_PERF_GROUPS; g++)
+    perf_group_leader[g] = -1;
+  int opened = 0;
+  for(int e=0; e<NUM_PERF_EVENTS; e++){
+    int g = perf_events[e].type == PERF_TYPE_SOFTWARE;
+    perf_fd[e] = open_perf_event(&perf_events[e], perf_group_leader[g]);
+    if(perf_fd[e] < 0)
+      continue;
+    if(perf_group_leader[g] < 0)
+      perf_group_leader[g] = perf_fd[e];
+    perf_group_events[g][perf_group_size[g]++] = e;
+    opened++;
+  }
+  if(opened == 0){
+    printf("Could not open any performance counters.\n");
     exit(-1);
   }
-  return s;
+  perf_current = PERF_LOAD;
+  read_perf(perf_last);
+}
+
+//Adds what was counted since the last reading to the current phase,
+//and to the running method when profiling.
+void perf_sample () {
+  double now[NUM_PERF_EVENTS];
+  memcpy(now, perf_last, sizeof(now));
+  read_perf(now);
+  int method = -1;
+  if(opt_profile && perf_current == PERF_RUN && prof_sp > 0){
+    if(!method_perf)
+      method_perf = calloc(nprof_methods * NUM_PERF_EVENTS, sizeof(double));
+    method = prof_stack[prof_sp - 1].method;
+  }
+  for(int e=0; e<NUM_PERF_EVENTS; e++){
+    double d = now[e] - perf_last[e];
+    perf_phase_counts[perf_current][e] += d;
+    if(method >= 0)
+      method_perf[method * NUM_PERF_EVENTS + e] += d;
+  }
+  memcpy(perf_last, now, sizeof(now));
+}
+
+void perf_phase (PerfPhase phase) {
+  if(!opt_perf)
+    return;
+  perf_sample();
+  perf_current = phase;
+}
+
+int perf_available (int e) {
+  return perf_fd[e] >= 0 && perf_counted[e];
+}
+
+//Prints one row of counts: IPC, misses per thousand instructions, the
+//task clock in milliseconds and the page faults.
+void print_perf_row (char* name, double* c) {
+  printf("   %-16.16s", name);
+  if(perf_available(CYCLES_EVENT))
+    printf(" %14.0f", c[CYCLES_EVENT]);
+  else
+    printf(" %14s", "n/a");
+  if(perf_available(INSTRUCTIONS_EVENT))
+    printf(" %14.0f", c[INSTRUCTIONS_EVENT]);
+  else
+    printf(" %14s", "n/a");
+  if(perf_available(CYCLES_EVENT) && perf_available(INSTRUCTIONS_EVENT) && c[CYCLES_EVENT] > 0)
+    printf(" %6.2f", c[INSTRUCTIONS_EVENT] / c[CYCLES_EVENT]);
+  else
+    printf(" %6s", "n/a");
+  for(int e=BRANCH_MISSES_EVENT; e<=DTLB_MISSES_EVENT; e++){
+    if(perf_available(e) && perf_available(INSTRUCTIONS_EVENT) && c[INSTRUCTIONS_EVENT] > 0)
+      printf(" %8.2f", c[e] * 1000 / c[INSTRUCTIONS_EVENT]);
+    else
+      printf(" %8s", "n/a");
+  }
+  if(perf_available(TASK_CLOCK_EVENT))
+    printf(" %10.3f", c[TASK_CLOCK_EVENT] / 1e6);
+  else
+    printf(" %10s", "n/a");
+  if(perf_available(PAGE_FAULTS_EVENT))
+    printf(" %8.0f", c[PAGE_FAULTS_EVENT]);
+  else
+    printf(" %8s", "n/a");
+  printf("\n");
+}
+
+void print_perf_header (char* first) {
+  printf("   %-16s %14s %14s %6s %8s %8s %8s %8s %10s %8s\n", first,
+         "cycles", "instructions", "IPC", "br-mpki", "L1d-mpki",
+         "LLC-mpki", "dTLB-mpki", "ms", "faults");
+}
+
+void print_perf () {
+  perf_sample();
+  printf("Performance counters :\n");
+  print_perf_header("phase");
+  double total[NUM_PERF_EVENTS] = {0};
+  for(int p=0; p<NUM_PERF_PHASES; p++){
+    print_perf_row(perf_phase_names[p], perf_phase_counts[p]);
+    for(int e=0; e<NUM_PERF_EVENTS; e++)
+      total[e] += perf_phase_counts[p][e];
+  }
+  print_perf_row("total", total);
+  for(int e=0; e<NUM_PERF_EVENTS; e++)
+    if(perf_fd[e] < 0)
+      printf("   %s: not available\n", perf_events[e].name);
+
+  if(!method_perf)
+    return;
+  //Methods with the most cycles, or the longest task clock if there
+  //is no cycle counter
+  int key = perf_available(CYCLES_EVENT)? CYCLES_EVENT : TASK_CLOCK_EVENT;
+  long* keys = malloc(sizeof(long) * nprof_methods);
+  int* order = malloc(sizeof(int) * nprof_methods);
+  for(int i=0; i<nprof_methods; i++)
+    keys[i] = method_perf[i * NUM_PERF_EVENTS + key];
+  sort_by_counts(order, keys, nprof_methods);
+  printf("Performance counters by method :\n");
+  print_perf_header("method");
+  for(int i=0; i<nprof_methods && i<PERF_TOP_METHODS; i++){
+    if(keys[order[i]] <= 0)
+      break;
+    print_perf_row(prof_methods[order[i]].name, method_perf + order[i] * NUM_PERF_EVENTS);
+  }
+  free(keys);
+  free(order);
 }
@@ -25,9 +25,37 @@ typedef enum {
   GOTO_INS,       //e
   RETURN_INS,     //f
   DROP_INS,       //10
-  FRAME_INS       //11
+  FRAME_INS,      //11
+  //Quickened forms of CALL_SLOT_INS
+  INT_EQ_INS,     //12
+  INT_LT_INS,     //13
+  INT_LE_INS,     //14
+  INT_GT_INS,     //15
+  INT_GE_INS,     //16
+  INT_ADD_INS,    //17
+  INT_SUB_INS,    //18
+  INT_MUL_INS,    //19
+  INT_DIV_INS,    //1a
+  INT_MOD_INS,    //1b
+  ARRAY_GET_INS,  //1c
+  ARRAY_SET_INS,  //1d
+  ARRAY_LENGTH_INS, //1e
+  //Superinstructions
+  GET_LOCAL2_INS,      //1f
+  GET_LOCAL_INT_INS,   //20
+  SET_LOCAL_DROP_INS,  //21
+  SET_GLOBAL_DROP_INS, //22
+  INT_EQ_BRANCH_INS,   //23
+  INT_LT_BRANCH_INS,   //24
+  INT_LE_BRANCH_INS,   //25
+  INT_GT_BRANCH_INS,   //26
+  INT_GE_BRANCH_INS,   //27
+  NUM_OPS
 } OpTag;
 
+//Linked instruction layouts. Each operand is aligned to its own size.
+//In threaded builds the tag is a handler address of type void*
+//instead of a char.
 //Int :
 //   tag: char
 //   value: int
@@ -41,14 +69,19 @@ typedef enum {
 //   class: short
 //Slot :
 //   tag: char
-//   name: char*
+//   name: int
+//   cache: InlineCache
 //SetSlot :
 //   tag: char
-//   name: char*
+//   name: int
+//   cache: InlineCache
 //CallSlot :
 //   tag: char
 //   arity: char
-//   name: char*
+//   name: int
+//   cache: InlineCache
+//Quickened CallSlot (INT_EQ_INS ... ARRAY_LENGTH_INS) :
+//   same layout as CallSlot
 //Call :
 //   tag: char
 //   arity: char
@@ -75,6 +108,213 @@ typedef enum {
 //   tag: char
 //   nargs: char
 //   nlocals: short
+//GetLocal2 :
+//   tag: char
+//   idx1: short
+//   idx2: short
+//GetLocalInt :
+//   tag: char
+//   idx: short
+//   value: int
+//SetLocalDrop :
+//   tag: char
+//   idx: short
+//SetGlobalDrop :
+//   tag: char
+//   idx: short
+//Quickened CallSlot followed by Branch (INT_EQ_BRANCH_INS ... INT_GE_BRANCH_INS) :
+//   same layout as CallSlot, the Branch is kept after it
+
+//Register instructions. With -regs, each method is translated into
+//three-address code that reads and writes frame registers directly
+//instead of going through the operand stack. Registers hold the
+//arguments and locals of the method followed by its temporaries.
+typedef enum {
+  REG_INT_INS,        //0
+  REG_NULL_INS,       //1
+  REG_MOV_INS,        //2
+  REG_PRINTF_INS,     //3
+  REG_ARRAY_INS,      //4
+  REG_OBJECT_INS,     //5
+  REG_SLOT_INS,       //6
+  REG_SET_SLOT_INS,   //7
+  REG_CALL_SLOT_INS,  //8
+  REG_CALL_INS,       //9
+  REG_SET_GLOBAL_INS, //a
+  REG_GET_GLOBAL_INS, //b
+  REG_BRANCH_INS,     //c
+  REG_GOTO_INS,       //d
+  REG_RETURN_INS,     //e
+  REG_FRAME_INS,      //f
+  //Builtin Int slots, in BuiltinSym order
+  REG_EQ_INS,         //10
+  REG_LT_INS,         //11
+  REG_LE_INS,         //12
+  REG_GT_INS,         //13
+  REG_GE_INS,         //14
+  REG_ADD_INS,        //15
+  REG_SUB_INS,        //16
+  REG_MUL_INS,        //17
+  REG_DIV_INS,        //18
+  REG_MOD_INS,        //19
+  REG_EQ_IMM_INS,     //1a
+  REG_LT_IMM_INS,     //1b
+  REG_LE_IMM_INS,     //1c
+  REG_GT_IMM_INS,     //1d
+  REG_GE_IMM_INS,     //1e
+  REG_ADD_IMM_INS,    //1f
+  REG_SUB_IMM_INS,    //20
+  REG_MUL_IMM_INS,    //21
+  REG_DIV_IMM_INS,    //22
+  REG_MOD_IMM_INS,    //23
+  REG_EQ_BRANCH_INS,  //24
+  REG_LT_BRANCH_INS,  //25
+  REG_LE_BRANCH_INS,  //26
+  REG_GT_BRANCH_INS,  //27
+  REG_GE_BRANCH_INS,  //28
+  REG_EQ_IMM_BRANCH_INS, //29
+  REG_LT_IMM_BRANCH_INS, //2a
+  REG_LE_IMM_BRANCH_INS, //2b
+  REG_GT_IMM_BRANCH_INS, //2c
+  REG_GE_IMM_BRANCH_INS, //2d
+  //Builtin Array slots
+  REG_ARRAY_GET_INS,     //2e
+  REG_ARRAY_SET_INS,     //2f
+  REG_ARRAY_LENGTH_INS,  //30
+  NUM_REG_OPS
+} RegOpTag;
+
+//Register instruction layouts. Registers are shorts.
+//RegInt :
+//   tag: char
+//   dst: short
+//   value: int
+//RegNull :
+//   tag: char
+//   dst: short
+//RegMov :
+//   tag: char
+//   dst: short
+//   src: short
+//RegPrintf :
+//   tag: char
+//   arity: char
+//   dst: short
+//   format: char*
+//   args: short[arity]
+//RegArray :
+//   tag: char
+//   dst: short
+//   length: short
+//   init: short
+//RegObject :
+//   tag: char
+//   arity: char
+//   class: short
+//   dst: short
+//   parent: short
+//   args: short[arity]
+//RegSlot :
+//   tag: char
+//   dst: short
+//   obj: short
+//   name: int
+//   cache: InlineCache
+//RegSetSlot :
+//   tag: char
+//   obj: short
+//   value: short
+//   name: int
+//   cache: InlineCache
+//RegCallSlot :
+//   tag: char
+//   arity: char
+//   dst: short
+//   name: int
+//   cache: InlineCache
+//   args: short[arity]
+//RegCall :
+//   tag: char
+//   arity: char
+//   dst: short
+//   code: void*
+//   args: short[arity]
+//RegSetGlobal :
+//   tag: char
+//   idx: short
+//   src: short
+//RegGetGlobal :
+//   tag: char
+//   dst: short
+//   idx: short
+//RegBranch :
+//   tag: char
+//   src: short
+//   code: void*
+//RegGoto :
+//   tag: char
+//   code: void*
+//RegReturn :
+//   tag: char
+//   src: short
+//RegFrame :
+//   tag: char
+//   nargs: char
+//   nregs: short
+//RegIntOp (REG_EQ_INS ... REG_MOD_INS) :
+//   tag: char
+//   dst: short
+//   x: short
+//   y: short
+//RegIntImmOp (REG_EQ_IMM_INS ... REG_MOD_IMM_INS) :
+//   tag: char
+//   dst: short
+//   x: short
+//   value: int
+//RegCompareBranch (REG_EQ_BRANCH_INS ... REG_GE_BRANCH_INS) :
+//   tag: char
+//   x: short
+//   y: short
+//   followed by a RegBranch on the result of the comparison
+//RegCompareImmBranch (REG_EQ_IMM_BRANCH_INS ... REG_GE_IMM_BRANCH_INS) :
+//   tag: char
+//   x: short
+//   value: int
+//   followed by a RegBranch on the result of the comparison
+//RegArrayGet :
+//   tag: char
+//   dst: short
+//   array: short
+//   index: short
+//RegArraySet :
+//   tag: char
+//   dst: short
+//   array: short
+//   index: short
+//   value: short
+//RegArrayLength :
+//   tag: char
+//   dst: short
+//   array: short
+
+//Slot names are interned into symbols by the linker. The names of
+//the builtin Int and Array slots always receive these ids.
+typedef enum {
+  EQ_SYM,
+  LT_SYM,
+  LE_SYM,
+  GT_SYM,
+  GE_SYM,
+  ADD_SYM,
+  SUB_SYM,
+  MUL_SYM,
+  DIV_SYM,
+  MOD_SYM,
+  GET_SYM,
+  SET_SYM,
+  LENGTH_SYM,
+  NUM_BUILTIN_SYMS
+} BuiltinSym;
 
 typedef enum {
   VAR_SLOT,
@@ -83,21 +323,86 @@ typedef enum {
 
 typedef struct {
   SlotTag tag;
-  char* name;
+  int name;
   union {
     int idx;
     void* code;
   };
 } LSlot;
 
+//table is an open addressing hash table from slot name to the index
+//of the slot in slots. Empty entries are -1.
 typedef struct {
   int nvars;
   int nslots;
   LSlot* slots;
+  int table_mask;
+  int* table;
 } LClass;
 
+//Inline caches map the class tag of a receiver to the slot that a
+//lookup resolved to. A slot found in the parent object is only valid
+//for the class of that parent, so such entries also record
+//parent_tag. It is -1 for slots found in the receiver itself.
+#define IC_SIZE 4
+#define IC_MEGAMORPHIC -1
+
+typedef struct {
+  long tag;
+  long parent_tag;
+  LSlot slot;
+} ICEntry;
+
+typedef struct {
+  long n;
+  ICEntry entries[IC_SIZE];
+} InlineCache;
+
+extern int opt_ic_stats;
+extern int opt_disasm;
+extern char* opt_super;
+extern char* opt_super_profile;
+extern char* opt_pair_profile;
+extern int opt_profile;
+extern char* opt_sample;
+extern char* opt_sample_rate;
+extern char* opt_trace;
+extern int opt_trace_calls;
+extern int opt_perf;
+extern int opt_regs;
+extern char* opt_heap_init;
+extern char* opt_heap_max;
+extern int opt_gen;
+extern char* opt_nursery;
+extern char* opt_gc_threads;
+extern int opt_gc_stats;
+extern char* opt_gc_log;
+extern char* opt_incremental;
+extern char* opt_large_array;
+extern int opt_immix;
+extern char* opt_copy_order;
+extern char* opt_pretenure;
+extern char* opt_backing;
+
+//Phases measured by -perf.
+typedef enum {
+  PERF_LOAD,
+  PERF_LINK,
+  PERF_INIT,
+  PERF_RUN,
+  PERF_GC,
+  NUM_PERF_PHASES
+} PerfPhase;
+
 char* link_program (Program* prog);
 void initvm (char* entry);
 void runvm ();
+void print_code ();
+double now_ms ();
+void start_trace ();
+void trace_phase (char* name, char* cat, double start);
+void finish_trace ();
+void start_perf ();
+void perf_phase (PerfPhase phase);
 
 #endif